@@ -0,0 +1,56 @@
+/* Copyright (C) 2016 Free Software Foundation, Inc.
+   Contributed by Agustina Arzille <avarzille@riseup.net>, 2016.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either
+   version 3 of the license, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with this program; if not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __BENCH_H__
+#define __BENCH_H__   1
+
+/* Helpers shared by the microbenchmarks. */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Current time, in nanoseconds. */
+static inline unsigned long long
+bench_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/* Print the result of a run of N iterations that started at T0. */
+static inline void
+bench_report (const char *name, unsigned long n, unsigned long long t0)
+{
+  unsigned long long ns = bench_now () - t0;
+  printf ("%-32s %10lu iters %12.1f ns/iter\n", name, n,
+    (double)ns / (n ? n : 1));
+}
+
+/* Get the numeric argument IDX, or DFL if it wasn't given. */
+static inline unsigned long
+bench_arg (int argc, char **argv, int idx, unsigned long dfl)
+{
+  return (idx < argc ? strtoul (argv[idx], NULL, 0) : dfl);
+}
+
+#endif
@@ -0,0 +1,95 @@
+/* Copyright (C) 2016 Free Software Foundation, Inc.
+   Contributed by Agustina Arzille <avarzille@riseup.net>, 2016.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either
+   version 3 of the license, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with this program; if not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Descriptor coloring benchmark.
+ *
+ * Starts many threads that each keep touching their descriptor and the
+ * top of their stack, yielding every so often so that threads sharing
+ * a processor interleave. If every descriptor sat at the same offset in
+ * a page, they would all compete for the same cache sets. The benchmark
+ * prints how many different cache line offsets the descriptors got, and
+ * the cost of an iteration. Run it as 'color [THREADS] [ITERATIONS]'. */
+
+#include "bench.h"
+#include <sched.h>
+
+#define LINE_SIZE    64
+#define PAGE_SIZE    4096
+#define YIELD_EVERY  64
+
+static unsigned long niters;
+static pthread_barrier_t barrier;
+
+static void*
+work (void *argp)
+{
+  volatile unsigned long frame[LINE_SIZE / sizeof (unsigned long)];
+  pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+
+  pthread_barrier_wait (&barrier);
+  for (unsigned long i = 0; i < niters; ++i)
+    {
+      /* Locking reads the descriptor, and the frame
+       * is near the top of the stack. */
+      pthread_mutex_lock (&mtx);
+      frame[i % (sizeof (frame) / sizeof (frame[0]))] += i;
+      pthread_mutex_unlock (&mtx);
+
+      if (i % YIELD_EVERY == 0)
+        sched_yield ();
+    }
+
+  return (argp);
+}
+
+int main (int argc, char **argv)
+{
+  unsigned long nthr = bench_arg (argc, argv, 1, 64);
+  niters = bench_arg (argc, argv, 2, 1000000);
+
+  pthread_t *thrs = (pthread_t *)malloc (nthr * sizeof (*thrs));
+  unsigned char seen[PAGE_SIZE / LINE_SIZE] = { 0 };
+  unsigned int ncolors = 0;
+
+  pthread_barrier_init (&barrier, NULL, nthr + 1);
+  for (unsigned long i = 0; i < nthr; ++i)
+    {
+      if (pthread_create (&thrs[i], NULL, work, NULL) != 0)
+        {
+          perror ("pthread_create");
+          return (1);
+        }
+
+      /* In this library, a thread's handle is its descriptor. */
+      unsigned long off = (unsigned long)thrs[i] % PAGE_SIZE / LINE_SIZE;
+      ncolors += !seen[off];
+      seen[off] = 1;
+    }
+
+  printf ("%lu threads, %u descriptor offsets\n", nthr, ncolors);
+
+  unsigned long long t0 = bench_now ();
+  pthread_barrier_wait (&barrier);
+  for (unsigned long i = 0; i < nthr; ++i)
+    pthread_join (thrs[i], NULL);
+
+  bench_report ("descriptor and stack top", nthr * niters, t0);
+  free (thrs);
+  return (0);
+}
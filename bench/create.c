@@ -0,0 +1,83 @@
+/* Copyright (C) 2016 Free Software Foundation, Inc.
+   Contributed by Agustina Arzille <avarzille@riseup.net>, 2016.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either
+   version 3 of the license, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with this program; if not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Thread creation benchmark.
+ *
+ * Measures the cost of creating and joining a thread that does nothing,
+ * and that of creating a thread that does a resolver call, so that the
+ * cost of setting up and clearing the per-thread resolver state shows
+ * up. Run it as 'create [ITERATIONS]'. */
+
+#include "bench.h"
+#include <resolv.h>
+
+static void*
+noop (void *argp)
+{
+  return (argp);
+}
+
+static void*
+resolve (void *argp)
+{
+  res_init ();
+  return (argp);
+}
+
+static void
+run (const char *name, void* (*fct) (void *),
+  const pthread_attr_t *attrp, unsigned long n)
+{
+  unsigned long long t0 = bench_now ();
+  for (unsigned long i = 0; i < n; ++i)
+    {
+      pthread_t th;
+      if (pthread_create (&th, attrp, fct, NULL) != 0)
+        {
+          perror ("pthread_create");
+          exit (1);
+        }
+
+      pthread_join (th, NULL);
+    }
+
+  bench_report (name, n, t0);
+}
+
+int main (int argc, char **argv)
+{
+  unsigned long n = bench_arg (argc, argv, 1, 100000);
+  pthread_attr_t attr;
+
+  /* Warm up the caches, so that the steady state is measured. */
+  run ("warmup", noop, NULL, n / 10);
+
+  run ("create+join", noop, NULL, n);
+  run ("create+join, res_init", resolve, NULL, n);
+  run ("create+join, after res_init", noop, NULL, n);
+
+  /* Threads with a small stack exercise the arenas
+   * rather than the pool. */
+  pthread_attr_init (&attr);
+  pthread_attr_setstacksize (&attr, 64 * 1024);
+  run ("create+join, 64K stack", noop, &attr, n);
+  pthread_attr_destroy (&attr);
+
+  return (0);
+}
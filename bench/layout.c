@@ -0,0 +1,104 @@
+/* Copyright (C) 2016 Free Software Foundation, Inc.
+   Contributed by Agustina Arzille <avarzille@riseup.net>, 2016.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either
+   version 3 of the license, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with this program; if not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Descriptor layout benchmark.
+ *
+ * Runs the fast paths that read the calling thread's descriptor (mutex
+ * ownership, thread-specific data and cancellation checks) in several
+ * threads at once, first on their own and then while another thread
+ * keeps creating and joining threads. The latter makes other threads
+ * write to the running list links of the workers, which shouldn't slow
+ * down the fast paths if those links are kept out of the hot line. Run
+ * it as 'layout [THREADS] [ITERATIONS]'. */
+
+#include "bench.h"
+
+static pthread_key_t key;
+static unsigned long niters;
+static volatile int churning;
+
+static void*
+work (void *argp)
+{
+  pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+  unsigned long sum = 0;
+
+  pthread_setspecific (key, &sum);
+  for (unsigned long i = 0; i < niters; ++i)
+    {
+      pthread_mutex_lock (&mtx);
+      sum += *(unsigned long *)pthread_getspecific (key) & 1;
+      pthread_mutex_unlock (&mtx);
+      pthread_testcancel ();
+    }
+
+  return ((void *)(sum + (unsigned long)argp));
+}
+
+static void*
+noop (void *argp)
+{
+  return (argp);
+}
+
+static void*
+churn (void *argp)
+{
+  while (churning)
+    {
+      pthread_t th;
+      if (pthread_create (&th, NULL, noop, NULL) == 0)
+        pthread_join (th, NULL);
+    }
+
+  return (argp);
+}
+
+static void
+run (const char *name, unsigned long nthr)
+{
+  pthread_t *thrs = (pthread_t *)malloc (nthr * sizeof (*thrs));
+  unsigned long long t0 = bench_now ();
+
+  for (unsigned long i = 0; i < nthr; ++i)
+    pthread_create (&thrs[i], NULL, work, NULL);
+  for (unsigned long i = 0; i < nthr; ++i)
+    pthread_join (thrs[i], NULL);
+
+  bench_report (name, nthr * niters, t0);
+  free (thrs);
+}
+
+int main (int argc, char **argv)
+{
+  unsigned long nthr = bench_arg (argc, argv, 1, 4);
+  niters = bench_arg (argc, argv, 2, 10000000);
+  pthread_key_create (&key, NULL);
+
+  run ("fast paths", nthr);
+
+  pthread_t th;
+  churning = 1;
+  pthread_create (&th, NULL, churn, NULL);
+  run ("fast paths, with churn", nthr);
+  churning = 0;
+  pthread_join (th, NULL);
+
+  return (0);
+}
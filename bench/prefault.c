@@ -0,0 +1,130 @@
+/* Copyright (C) 2016 Free Software Foundation, Inc.
+   Contributed by Agustina Arzille <avarzille@riseup.net>, 2016.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either
+   version 3 of the license, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with this program; if not, see
+   <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Stack prefaulting benchmark.
+ *
+ * Starts a batch of threads that each use some amount of stack right
+ * away, and measures how long that takes them, with and without asking
+ * for the stack to be prefaulted. The threads stay alive until the whole
+ * batch has run, so that every one of them gets a fresh stack. Run it
+ * as 'prefault [THREADS] [KBYTES] [on|off]'.
+ *
+ * Each mode is run in a process of its own, so that neither gets to
+ * reuse the stacks the other already faulted in. Without a mode, the
+ * program runs itself once for each. */
+
+#include "bench.h"
+#include <alloca.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static size_t depth;
+static pthread_barrier_t barrier;
+static unsigned long long total;
+
+static void*
+work (void *argp)
+{
+  unsigned long long t0 = bench_now ();
+  char *p = (char *)alloca (depth);
+
+  memset (p, 1, depth);
+  __atomic_add_fetch (&total, bench_now () - t0, __ATOMIC_RELAXED);
+
+  pthread_barrier_wait (&barrier);
+  return (argp);
+}
+
+static void
+run (const char *name, unsigned long nthr, size_t prefault)
+{
+  pthread_t *thrs = (pthread_t *)malloc (nthr * sizeof (*thrs));
+  pthread_attr_t attr;
+
+  pthread_attr_init (&attr);
+  pthread_attr_setstacksize (&attr, depth + 64 * 1024);
+  pthread_attr_setprefault_np (&attr, prefault);
+  pthread_barrier_init (&barrier, NULL, nthr);
+  total = 0;
+
+  unsigned long long t0 = bench_now ();
+  for (unsigned long i = 0; i < nthr; ++i)
+    if (pthread_create (&thrs[i], &attr, work, NULL) != 0)
+      {
+        perror ("pthread_create");
+        exit (1);
+      }
+
+  for (unsigned long i = 0; i < nthr; ++i)
+    pthread_join (thrs[i], NULL);
+
+  bench_report (name, nthr, t0);
+  printf ("%-32s %10lu iters %12.1f ns/iter\n", "  of which, in the thread",
+    nthr, (double)total / nthr);
+
+  pthread_barrier_destroy (&barrier);
+  pthread_attr_destroy (&attr);
+  free (thrs);
+}
+
+/* Run this program again in a child process, in mode MODE. */
+static void
+spawn (char **argv, const char *mode)
+{
+  char *args[] = { argv[0], argv[1], argv[2], (char *)mode, NULL };
+  pid_t pid = fork ();
+
+  if (pid == 0)
+    {
+      execv (argv[0], args);
+      perror ("execv");
+      _exit (1);
+    }
+  else if (pid < 0 || waitpid (pid, NULL, 0) < 0)
+    {
+      perror ("fork");
+      exit (1);
+    }
+}
+
+int main (int argc, char **argv)
+{
+  unsigned long nthr = bench_arg (argc, argv, 1, 256);
+  depth = bench_arg (argc, argv, 2, 256) * 1024;
+
+  if (argc > 3)
+    {
+      if (strcmp (argv[3], "on") == 0)
+        run ("prefault", nthr, depth + 4096);
+      else
+        run ("no prefault", nthr, 0);
+    }
+  else
+    {
+      char nbuf[32], dbuf[32];
+      char *args[] = { argv[0], nbuf, dbuf };
+
+      snprintf (nbuf, sizeof (nbuf), "%lu", nthr);
+      snprintf (dbuf, sizeof (dbuf), "%lu", (unsigned long)(depth / 1024));
+      spawn (args, "off");
+      spawn (args, "on");
+    }
+
+  return (0);
+}
@@ -17,13 +17,33 @@
 */
 
 #include "pt-internal.h"
+#include "lowlevellock.h"
+#include "../sysdeps/atomic.h"
 #include <errno.h>
 #include <sched.h>
 #include <mach_init.h>
 
+/* Serializes changes to the default attributes. Thread creation reads
+ * single members of them at a time, so it doesn't need to take it. */
+static unsigned int dfl_attr_lock;
+
 int pthread_attr_init (pthread_attr_t *attrp)
 {
-  *attrp = __pthread_dfl_attr;
+  static const pthread_attr_t dfl_attr =
+    {
+      .__flags = PTHREAD_CREATE_JOINABLE | PTHREAD_INHERIT_SCHED,
+      .__sched = { .__policy = SCHED_OTHER }
+    };
+
+  /* Only the sizes are taken from the defaults that may have been
+   * set by 'pthread_setattr_default_np'. The rest is as per POSIX. */
+  *attrp = dfl_attr;
+  lll_lock (&dfl_attr_lock, 0);
+  attrp->__stacksize = __pthread_dfl_attr.__stacksize;
+  attrp->__guardsize = __pthread_dfl_attr.__guardsize;
+  attrp->__prefault = __pthread_dfl_attr.__prefault;
+  lll_unlock (&dfl_attr_lock, 0);
+
   return (0);
 }
 
@@ -107,6 +127,18 @@ int pthread_attr_getguardsize (const pthread_attr_t *attrp, size_t *outp)
   return (0);
 }
 
+int pthread_attr_setprefault_np (pthread_attr_t *attrp, size_t size)
+{
+  attrp->__prefault = size;
+  return (0);
+}
+
+int pthread_attr_getprefault_np (const pthread_attr_t *attrp, size_t *outp)
+{
+  *outp = attrp->__prefault;
+  return (0);
+}
+
 int pthread_attr_setscope (pthread_attr_t *attrp, int scope)
 {
   (void)attrp;
@@ -171,6 +203,7 @@ int pthread_getattr_np (pthread_t th, pthread_attr_t *attrp)
   attrp->__stack = pt->stack + 
     (attrp->__stacksize = pt->stacksize);
   attrp->__guardsize = pt->guardsize;
+  attrp->__prefault = 0;
   attrp->__flags = DETACHED_P (pt) ?
     PTHREAD_CREATE_DETACHED : PTHREAD_CREATE_JOINABLE;
 
@@ -187,3 +220,32 @@ int pthread_attr_destroy (pthread_attr_t *attrp)
   return (0);
 }
 
+int pthread_setattr_default_np (const pthread_attr_t *attrp)
+{
+  /* A stack can't be shared by every new thread. */
+  if (attrp->__stack != NULL)
+    return (EINVAL);
+  else if (attrp->__stacksize != 0 && attrp->__stacksize < PTHREAD_STACK_MIN)
+    return (EINVAL);
+
+  lll_lock (&dfl_attr_lock, 0);
+  if (attrp->__stacksize != 0)
+    atomic_store (&__pthread_dfl_attr.__stacksize, attrp->__stacksize);
+
+  atomic_store (&__pthread_dfl_attr.__guardsize, attrp->__guardsize);
+  atomic_store (&__pthread_dfl_attr.__flags, attrp->__flags);
+  atomic_store (&__pthread_dfl_attr.__prefault, attrp->__prefault);
+  __pthread_dfl_attr.__sched = attrp->__sched;
+  lll_unlock (&dfl_attr_lock, 0);
+
+  return (0);
+}
+
+int pthread_getattr_default_np (pthread_attr_t *attrp)
+{
+  lll_lock (&dfl_attr_lock, 0);
+  *attrp = __pthread_dfl_attr;
+  lll_unlock (&dfl_attr_lock, 0);
+
+  return (0);
+}
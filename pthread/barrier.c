@@ -21,8 +21,23 @@
 #include "../sysdeps/atomic.h"
 #include "sysdep.h"
 #include <errno.h>
+#include <stdlib.h>
 
-static const pthread_barrierattr_t dfl_attr;
+/* Barrier flags. The lower bits are reserved for gsync flags. */
+#define BARRIER_TREE       0x100
+#define BARRIER_ADAPTIVE   0x200
+
+/* Token flags. */
+#define TOKEN_SERIAL   0x01
+#define TOKEN_DONE     0x02
+
+/* Pseudo-operation for waits that don't reduce anything. */
+#define REDUCE_NONE   (-1)
+
+static const pthread_barrierattr_t dfl_attr =
+{
+  .__spins = PTHREAD_BARRIER_SPIN_ADAPTIVE_NP
+};
 
 int pthread_barrierattr_init (pthread_barrierattr_t *attrp)
 {
@@ -49,12 +64,381 @@ int pthread_barrierattr_getpshared (const pthread_barrierattr_t *attrp,
   return (0);
 }
 
+int pthread_barrierattr_settype_np (pthread_barrierattr_t *attrp, int type)
+{
+  if (type != PTHREAD_BARRIER_CENTRAL_NP &&
+      type != PTHREAD_BARRIER_TREE_NP)
+    return (EINVAL);
+
+  attrp->__flags = (attrp->__flags & ~BARRIER_TREE) |
+    (type == PTHREAD_BARRIER_TREE_NP ? BARRIER_TREE : 0);
+  return (0);
+}
+
+int pthread_barrierattr_gettype_np (const pthread_barrierattr_t *attrp,
+  int *outp)
+{
+  *outp = (attrp->__flags & BARRIER_TREE) ?
+    PTHREAD_BARRIER_TREE_NP : PTHREAD_BARRIER_CENTRAL_NP;
+  return (0);
+}
+
+int pthread_barrierattr_setspin_np (pthread_barrierattr_t *attrp, int spins)
+{
+  if (spins < 0 && spins != PTHREAD_BARRIER_SPIN_ADAPTIVE_NP)
+    return (EINVAL);
+
+  attrp->__spins = spins;
+  return (0);
+}
+
+int pthread_barrierattr_getspin_np (const pthread_barrierattr_t *attrp,
+  int *outp)
+{
+  *outp = attrp->__spins;
+  return (0);
+}
+
 int pthread_barrierattr_destroy (pthread_barrierattr_t *attrp)
 {
   (void)attrp;
   return (0);
 }
 
+/* Waiters spin on the word that signals the barrier's release before
+ * going to sleep. Sleepers register themselves in a counter next to that
+ * word, so that the release can skip the wakeup request entirely when
+ * every waiter is still spinning.
+ *
+ * For adaptive barriers, the spin window tracks how long previous
+ * waiters had to spin before the barrier was released, and shrinks
+ * when they ended up sleeping anyway. Tree barriers keep an estimate
+ * per node, so that waiters don't all write to the same line. */
+
+#define BARRIER_SPIN_MIN   16
+#define BARRIER_SPIN_MAX   8192
+
+/* Spin until *PTR becomes VAL, or the spin window of barrier BARP
+ * elapses. For adaptive barriers, the window is derived from, and
+ * fed back into, the estimate at ESTP. Returns nonzero if the value
+ * was seen. */
+static int
+barrier_spin (pthread_barrier_t *barp, int *estp,
+  unsigned int *ptr, unsigned int val)
+{
+  int adaptive = barp->__flags & BARRIER_ADAPTIVE;
+  int est = atomic_load (adaptive ? estp : &barp->__spins);
+  int cnt, nest, max = est;
+
+  if (adaptive)
+    {
+      max = est * 2 + BARRIER_SPIN_MIN;
+      if (max > BARRIER_SPIN_MAX)
+        max = BARRIER_SPIN_MAX;
+    }
+
+  for (cnt = 0; cnt < max; ++cnt)
+    {
+      if (atomic_load (ptr) == val)
+        break;
+
+      atomic_spin_nop ();
+    }
+
+  if (adaptive)
+    {
+      /* The update is racy, but it's only a hint. Skip it once
+       * the estimate settles, so that the line stays shared. */
+      nest = cnt < max ? est + (cnt - est) / 8 : est - (est + 7) / 8;
+      if (nest != est)
+        atomic_store (estp, nest);
+    }
+
+  return (cnt < max);
+}
+
+/* Sleep until *PTR becomes VAL, registering in *NSLEEPP. */
+static void
+barrier_sleep (unsigned int *ptr, unsigned int val,
+  unsigned int *nsleepp, int pshared)
+{
+  unsigned int tmp;
+
+  atomic_add (nsleepp, 1);
+  while ((tmp = atomic_load (ptr)) != val)
+    lll_wait (ptr, tmp, pshared);
+  atomic_add (nsleepp, -1);
+}
+
+/* Store VAL in *PTR, and wake the threads sleeping on it, if any. */
+static void
+barrier_release (unsigned int *ptr, unsigned int val,
+  unsigned int *nsleepp, int pshared)
+{
+  atomic_store (ptr, val);
+
+  /* Order the store above with the load of the sleepers count. Sleepers
+   * register before checking the value, so one of us will notice. */
+  atomic_mfence ();
+  if (atomic_load (nsleepp) != 0)
+    lll_wake (ptr, pshared | GSYNC_BROADCAST);
+}
+
+/* Reductions.
+ *
+ * Every participant folds its value into an accumulator before its
+ * arrival is counted, so the thread that completes the barrier sees
+ * the final result, and publishes it before releasing the rest. The
+ * accumulators are tagged with the sequence number of the episode
+ * they belong to, so they never need to be reset. */
+
+static long
+reduce_fold (int op, long x, long y)
+{
+  switch (op)
+    {
+      case PTHREAD_BARRIER_REDUCE_SUM_NP:
+        return ((long)((unsigned long)x + (unsigned long)y));
+      case PTHREAD_BARRIER_REDUCE_MIN_NP:
+        return (x < y ? x : y);
+      case PTHREAD_BARRIER_REDUCE_MAX_NP:
+        return (x > y ? x : y);
+      case PTHREAD_BARRIER_REDUCE_AND_NP:
+        return (x & y);
+      case PTHREAD_BARRIER_REDUCE_OR_NP:
+        return (x | y);
+      default:
+        return (x ^ y);
+    }
+}
+
+/* Tree barriers.
+ *
+ * Arrivals are combined in a tree with a fan-in of BARRIER_ARITY, whose
+ * nodes sit in separate cache lines. A thread registers at one of the
+ * leaves; the last one to arrive at a node moves on to its parent, while
+ * the rest sleep on the node itself. The thread that completes the root
+ * is the serial one. Upon release, every thread wakes the nodes it
+ * completed on its way up, so that wakeups fan out down the tree and no
+ * single request has to wake more than BARRIER_ARITY - 1 threads.
+ *
+ * Arrival counts are tagged with the barrier sequence number, so that
+ * nodes don't need to be reset between episodes: a stale tag simply
+ * means that the count is zero. The partial reduction for a node is
+ * kept in the same word, and an arrival folds its value with the same
+ * atomic operation that counts it, so that the thread that completes
+ * the node carries its result up to the parent.
+ *
+ * With split-phase waits, the nodes a thread completed are released
+ * only once it completes its wait, since it's the one that wakes them. */
+
+#define BARRIER_ARITY   4
+
+/* Enough for 2^32 participants. */
+#define BARRIER_MAX_DEPTH   16
+
+#define BARRIER_NO_PARENT   (~0U)
+
+/* The arrival count of a node lives in the low bits of its tag. */
+#define NODE_CNT_BITS   8
+#define NODE_CNT_MASK   ((1U << NODE_CNT_BITS) - 1)
+#define NODE_TAG(seq)   ((seq) << NODE_CNT_BITS)
+
+struct barrier_node
+{
+  /* Partial reduction in the low limb; arrival count and sequence
+   * number in the high one. */
+  union hurd_xint val_tag;
+
+  /* Sequence number of the last episode this node was released for,
+   * plus one. Waiters sleep on this address. */
+  unsigned int release;
+
+  /* Number of threads sleeping on the above. */
+  unsigned int nsleep;
+
+  /* Spin estimate for the waiters of this node (adaptive barriers). */
+  int spins;
+
+  /* Number of arrivals that complete this node. */
+  unsigned int cap;
+
+  /* Index of the parent node. */
+  unsigned int parent;
+} __attribute__ ((aligned (64)));
+
+struct barrier_tree
+{
+  unsigned int nleaves;
+  unsigned int nnodes;
+  struct barrier_node nodes[] __attribute__ ((aligned (64)));
+};
+
+static struct barrier_tree*
+tree_alloc (unsigned int cnt)
+{
+  unsigned int nnodes = 0, width = cnt;
+
+  /* Count the nodes needed for every level. */
+  do
+    {
+      width = (width + BARRIER_ARITY - 1) / BARRIER_ARITY;
+      nnodes += width;
+    }
+  while (width > 1);
+
+  void *ptr;
+  if (posix_memalign (&ptr, __alignof__ (struct barrier_node),
+      sizeof (struct barrier_tree) + nnodes *
+      sizeof (struct barrier_node)) != 0)
+    return (NULL);
+
+  struct barrier_tree *tp = (struct barrier_tree *)ptr;
+  unsigned int base = 0, next;
+
+  tp->nnodes = nnodes;
+  tp->nleaves = width = (cnt + BARRIER_ARITY - 1) / BARRIER_ARITY;
+
+  /* Fill the levels bottom-up. The caps of a level are the number of
+   * participants (for the leaves) or children (for the rest) that it
+   * must combine. */
+  for (unsigned int below = cnt; ; below = width,
+      width = (width + BARRIER_ARITY - 1) / BARRIER_ARITY)
+    {
+      next = base + width;
+      for (unsigned int i = 0; i < width; ++i)
+        {
+          struct barrier_node *np = &tp->nodes[base + i];
+          np->val_tag.qv = 0;
+          np->release = np->nsleep = 0;
+          np->spins = 0;
+          np->cap = below - i * BARRIER_ARITY < BARRIER_ARITY ?
+            below - i * BARRIER_ARITY : BARRIER_ARITY;
+          np->parent = width == 1 ?
+            BARRIER_NO_PARENT : next + i / BARRIER_ARITY;
+        }
+
+      if (width == 1)
+        break;
+
+      base = next;
+    }
+
+  return (tp);
+}
+
+/* Register an arrival at node NP for episode SEQ, folding *VALP with
+ * operation OP. Returns 1 if the caller completed the node, 0 if it
+ * didn't, and -1 if the node was already complete. On success, *VALP
+ * is set to the node's partial reduction. */
+static int
+node_arrive (struct barrier_node *np, unsigned int seq, int op, long *valp)
+{
+  while (1)
+    {
+      union hurd_xint tmp = { atomic_loadx (&np->val_tag.qv) };
+      unsigned int cnt = (tmp.hi & ~NODE_CNT_MASK) == NODE_TAG (seq) ?
+        tmp.hi & NODE_CNT_MASK : 0;
+
+      if (cnt == np->cap)
+        return (-1);
+
+      long val = cnt == 0 || op == REDUCE_NONE ?
+        *valp : reduce_fold (op, (long)tmp.lo, *valp);
+
+      if (atomic_casx_bool (&np->val_tag.qv, tmp.lo, tmp.hi,
+          (unsigned int)val, NODE_TAG (seq) | (cnt + 1)))
+        {
+          *valp = val;
+          return (cnt + 1 == np->cap);
+        }
+    }
+}
+
+static void
+node_wait (pthread_barrier_t *barp, struct barrier_node *np,
+  unsigned int seq, int pshared)
+{
+  if (!barrier_spin (barp, &np->spins, &np->release, seq + 1))
+    barrier_sleep (&np->release, seq + 1, &np->nsleep, pshared);
+}
+
+static void
+node_release (struct barrier_node *np, unsigned int seq, int pshared)
+{
+  barrier_release (&np->release, seq + 1, &np->nsleep, pshared);
+}
+
+static void
+tree_arrive (pthread_barrier_t *barp, pthread_barrier_token_t *tokp,
+  int pshared, int op, long val)
+{
+  struct barrier_tree *tp = (struct barrier_tree *)barp->__nodes;
+  struct pthread *self = PTHREAD_SELF;
+  unsigned int path[BARRIER_MAX_DEPTH];
+  unsigned int seq = atomic_load (&barp->__seq_cnt.lo);
+  unsigned int idx = (self != NULL ? self->id : 0) % tp->nleaves;
+  int depth = 0, res;
+
+  /* Find a leaf with room for us. Since the leaves can hold exactly
+   * as many threads as participants, this always terminates. */
+  while ((res = node_arrive (&tp->nodes[idx], seq, op, &val)) < 0)
+    idx = (idx + 1) % tp->nleaves;
+
+  tokp->__seq = seq;
+  tokp->__leaf = idx;
+  tokp->__flags = 0;
+
+  /* Keep climbing as long as we complete nodes. */
+  while (res > 0)
+    {
+      path[depth++] = idx;
+      if ((idx = tp->nodes[idx].parent) == BARRIER_NO_PARENT)
+        break;
+
+      res = node_arrive (&tp->nodes[idx], seq, op, &val);
+    }
+
+  if (idx == BARRIER_NO_PARENT)
+    {
+      /* We completed the root. Publish the reduction, bump the sequence
+       * number, and release the nodes we completed right away, from the
+       * top down. */
+      barp->__result = val;
+      atomic_store (&barp->__seq_cnt.lo, seq + 1);
+      while (--depth >= 0)
+        node_release (&tp->nodes[path[depth]], seq, pshared);
+
+      tokp->__flags = TOKEN_SERIAL | TOKEN_DONE;
+    }
+
+  /* The path can be recomputed from the leaf and the depth. */
+  tokp->__depth = depth;
+}
+
+static void
+tree_wait_token (pthread_barrier_t *barp,
+  const pthread_barrier_token_t *tokp, int pshared)
+{
+  struct barrier_tree *tp = (struct barrier_tree *)barp->__nodes;
+  unsigned int path[BARRIER_MAX_DEPTH];
+  unsigned int idx = tokp->__leaf;
+  int depth;
+
+  for (depth = 0; depth < tokp->__depth; ++depth)
+    {
+      path[depth] = idx;
+      idx = tp->nodes[idx].parent;
+    }
+
+  /* Wait on the node we didn't complete. */
+  node_wait (barp, &tp->nodes[idx], tokp->__seq, pshared);
+
+  /* Release the nodes we completed, from the top down. */
+  while (--depth >= 0)
+    node_release (&tp->nodes[path[depth]], tokp->__seq, pshared);
+}
+
 int pthread_barrier_init (pthread_barrier_t *barp,
   const pthread_barrierattr_t *attrp, unsigned int cnt)
 {
@@ -63,53 +447,183 @@ int pthread_barrier_init (pthread_barrier_t *barp,
   else if (attrp == NULL)
     attrp = &dfl_attr;
 
+  barp->__nodes = NULL;
+  if (attrp->__flags & BARRIER_TREE)
+    {
+      /* The tree is allocated in private memory. */
+      if (attrp->__flags & GSYNC_SHARED)
+        return (EINVAL);
+      else if ((barp->__nodes = tree_alloc (cnt)) == NULL)
+        return (ENOMEM);
+    }
+
   barp->__seq_cnt.qv = 0;
   barp->__nrefs = 1;
   barp->__total = cnt - 1;
   barp->__flags = attrp->__flags;
+  barp->__nsleep = 0;
+
+  /* Tag the accumulator as belonging to the previous episode. */
+  barp->__acc.lo = 0;
+  barp->__acc.hi = ~0U;
+
+  if (attrp->__spins == PTHREAD_BARRIER_SPIN_ADAPTIVE_NP)
+    {
+      barp->__flags |= BARRIER_ADAPTIVE;
+      barp->__spins = 0;
+    }
+  else
+    barp->__spins = attrp->__spins;
 
   return (0);
 }
 
-int pthread_barrier_wait (pthread_barrier_t *barp)
+static void
+central_fold (pthread_barrier_t *barp, unsigned int seq, int op, long val)
 {
-  int ret = 0, pshared = barp->__flags & GSYNC_SHARED;
-  atomic_add (&barp->__nrefs, 1);
+  while (1)
+    {
+      union hurd_xint tmp = { atomic_loadx (&barp->__acc.qv) };
+      long nval = tmp.hi == seq ? reduce_fold (op, (long)tmp.lo, val) : val;
 
-  do
+      if (atomic_casx_bool (&barp->__acc.qv, tmp.lo, tmp.hi,
+          (unsigned int)nval, seq))
+        break;
+    }
+}
+
+static void
+central_arrive (pthread_barrier_t *barp, pthread_barrier_token_t *tokp,
+  int pshared, int op, long val)
+{
+  unsigned int seq = atomic_load (&barp->__seq_cnt.lo);
+
+  /* Fold our value before being counted. */
+  if (op != REDUCE_NONE)
+    central_fold (barp, seq, op, val);
+
+  unsigned int cnt = atomic_add (&barp->__seq_cnt.hi, 1);
+
+  tokp->__seq = seq;
+  tokp->__flags = 0;
+
+  if (cnt == barp->__total)
     {
-      unsigned int seq = atomic_load (&barp->__seq_cnt.lo);
-      unsigned int cnt = atomic_add (&barp->__seq_cnt.hi, 1);
+      /* Every participant has folded its value by now. */
+      if (op != REDUCE_NONE)
+        barp->__result = (long)atomic_load (&barp->__acc.lo);
 
-      if (cnt < barp->__total)
-        {
-          /* Sleep on the sequence address as long as we
-           * cannot proceed. */
-          while (barp->__seq_cnt.lo == seq)
-            lll_wait (&barp->__seq_cnt.lo, seq, pshared);
-        }
-      else if (cnt == barp->__total)
-        {
-          /* Clear count and bump sequence number. */
-          atomic_storex (&barp->__seq_cnt.qv, barp->__seq_cnt.lo + 1);
+      /* Clear count and bump sequence number. */
+      atomic_storex (&barp->__seq_cnt.qv, barp->__seq_cnt.lo + 1);
 
-          /* Tell everyone that we're done. */
-          lll_wake (&barp->__seq_cnt.lo, pshared | GSYNC_BROADCAST);
-          ret = PTHREAD_BARRIER_SERIAL_THREAD;
-        }
-      else
-        {
-          /* Wait for the barrier to be released. */
-          lll_wait (&barp->__seq_cnt.lo, seq, pshared);
-          continue;
-        }
+      /* Tell everyone that we're done. */
+      atomic_mfence ();
+      if (atomic_load (&barp->__nsleep) != 0)
+        lll_wake (&barp->__seq_cnt.lo, pshared | GSYNC_BROADCAST);
+      tokp->__flags = TOKEN_SERIAL | TOKEN_DONE;
+    }
+  else if (cnt > barp->__total)
+    {
+      /* Wait for the barrier to be released. */
+      atomic_add (&barp->__nsleep, 1);
+      lll_wait (&barp->__seq_cnt.lo, seq, pshared);
+      atomic_add (&barp->__nsleep, -1);
+      tokp->__flags = TOKEN_DONE;
     }
-  while (0);
+}
+
+static void
+central_wait_token (pthread_barrier_t *barp,
+  const pthread_barrier_token_t *tokp, int pshared)
+{
+  /* Spin, and then sleep on the sequence address as
+   * long as we cannot proceed. */
+  if (!barrier_spin (barp, &barp->__spins,
+      &barp->__seq_cnt.lo, tokp->__seq + 1))
+    barrier_sleep (&barp->__seq_cnt.lo, tokp->__seq + 1,
+      &barp->__nsleep, pshared);
+}
+
+static void
+barrier_arrive (pthread_barrier_t *barp,
+  pthread_barrier_token_t *tokp, int op, long val)
+{
+  int pshared = barp->__flags & GSYNC_SHARED;
+
+  /* The reference is dropped once the wait is complete. */
+  atomic_add (&barp->__nrefs, 1);
+
+  if (barp->__flags & BARRIER_TREE)
+    tree_arrive (barp, tokp, pshared, op, val);
+  else
+    central_arrive (barp, tokp, pshared, op, val);
+}
+
+static int
+barrier_wait_token (pthread_barrier_t *barp,
+  const pthread_barrier_token_t *tokp)
+{
+  int pshared = barp->__flags & GSYNC_SHARED;
+
+  if (tokp->__flags & TOKEN_DONE)
+    ;
+  else if (barp->__flags & BARRIER_TREE)
+    tree_wait_token (barp, tokp, pshared);
+  else
+    central_wait_token (barp, tokp, pshared);
 
+  return ((tokp->__flags & TOKEN_SERIAL) ?
+    PTHREAD_BARRIER_SERIAL_THREAD : 0);
+}
+
+static void
+barrier_unref (pthread_barrier_t *barp)
+{
   /* If we are the last to wake up, notify the destroying thread. */
   if (atomic_add (&barp->__nrefs, -1) == 1)
-    lll_wake (&barp->__nrefs, pshared);
+    lll_wake (&barp->__nrefs, barp->__flags & GSYNC_SHARED);
+}
+
+int pthread_barrier_arrive_np (pthread_barrier_t *barp,
+  pthread_barrier_token_t *tokp)
+{
+  barrier_arrive (barp, tokp, REDUCE_NONE, 0);
+  return (0);
+}
 
+int pthread_barrier_wait_token_np (pthread_barrier_t *barp,
+  const pthread_barrier_token_t *tokp)
+{
+  int ret = barrier_wait_token (barp, tokp);
+  barrier_unref (barp);
+  return (ret);
+}
+
+int pthread_barrier_wait (pthread_barrier_t *barp)
+{
+  pthread_barrier_token_t tok;
+
+  barrier_arrive (barp, &tok, REDUCE_NONE, 0);
+  return (pthread_barrier_wait_token_np (barp, &tok));
+}
+
+int pthread_barrier_wait_reduce_np (pthread_barrier_t *barp,
+  long *valp, int op)
+{
+  pthread_barrier_token_t tok;
+  int ret;
+
+  if (__glibc_unlikely (op < PTHREAD_BARRIER_REDUCE_SUM_NP ||
+      op > PTHREAD_BARRIER_REDUCE_XOR_NP))
+    return (EINVAL);
+
+  barrier_arrive (barp, &tok, op, *valp);
+  ret = barrier_wait_token (barp, &tok);
+
+  /* The result stays put until every participant arrives
+   * again, which includes us. */
+  *valp = atomic_load (&barp->__result);
+  barrier_unref (barp);
   return (ret);
 }
 
@@ -125,6 +639,6 @@ int pthread_barrier_destroy (pthread_barrier_t *barp)
       refc = atomic_load (&barp->__nrefs);
     }
 
+  free (barp->__nodes);
   return (0);
 }
-
@@ -26,8 +26,9 @@
 #include <mach.h>
 #include <mach/mig_support.h>
 #include <string.h>
+#include <stdlib.h>
 #include <stdbool.h>
-#include <locale.h>
+#include <link.h>
 
 #define PTHREAD_MPROT   (VM_PROT_READ | VM_PROT_WRITE | VM_PROT_EXECUTE)
 
@@ -40,66 +41,1164 @@
 
 extern void* _dl_allocate_tls (void *) internal_function;
 extern void _dl_deallocate_tls (void *, bool) internal_function;
+extern void* _dl_allocate_tls_init (void *) internal_function;
+
+#define TLS_DTV_UNALLOCATED   ((void *)-1l)
+
+/* Cache of TCB's, so that creating a thread can reuse the memory of an
+ * exited one. The cache is a fixed array of slots, and blocks are moved
+ * in and out with single-word atomic operations. No thread ever has to
+ * follow a link out of a cached block, so there's no ABA problem, and
+ * blocks can be freed at any time. The number of blocks is bounded;
+ * the ones that don't fit are returned to the dynamic linker.
+ *
+ * An exiting thread keeps running on its TCB until the kernel is done
+ * with it, so it leaves the block in its descriptor. Whoever reclaims
+ * the descriptor after the thread is dead also takes care of the TCB.
+ * Blocks are cached as they were left, and only prepared for their new
+ * owner when they're reused, so that they can still be released as a
+ * whole in the meantime. Preparing a block keeps its DTV, unless the
+ * set of loaded objects has changed since it was set up.
+ *
+ * Every TLS_CACHE_TRIM blocks put into the cache, it's trimmed: if
+ * none was taken out in the meantime, half of the blocks are released,
+ * so that a burst of exits doesn't pin memory forever. */
+
+#define TLS_CACHE_MAX    64
+#define TLS_CACHE_TRIM   64
+
+static void *tls_cache[TLS_CACHE_MAX];
+
+/* Number of cached blocks, plus the slots reserved for
+ * blocks about to be cached. */
+static unsigned int tls_cache_cnt;
+
+/* Number of blocks put into the cache, and taken out
+ * of it since the last trim. */
+static unsigned int tls_cache_puts;
+static unsigned int tls_cache_hits;
+
+static void*
+tls_cache_take (void)
+{
+  if (atomic_load (&tls_cache_cnt) == 0)
+    return (NULL);
+
+  for (int i = 0; i < TLS_CACHE_MAX; ++i)
+    if (atomic_load (&tls_cache[i]) != NULL)
+      {
+        void *tcb = atomic_swap (&tls_cache[i], NULL);
+        if (tcb != NULL)
+          {
+            atomic_add (&tls_cache_cnt, -1);
+            return (tcb);
+          }
+      }
+
+  return (NULL);
+}
+
+/* The dynamic linker doesn't export its TLS generation, so the objects
+ * loaded and unloaded, as counted by 'dl_iterate_phdr', stand for it.
+ * TLS_GENERATION is the DTV generation of a block that was set up when
+ * that count was TLS_LOADS. */
+static unsigned long long tls_loads;
+static size_t tls_generation;
+static unsigned int tls_gen_lock;
+
+static int
+tls_loads_cb (struct dl_phdr_info *info, size_t size, void *argp)
+{
+  (void)size;
+  *(unsigned long long *)argp = info->dlpi_adds + info->dlpi_subs;
+  return (1);
+}
+
+/* Set up the dead block TCB for its new owner. If no object was loaded
+ * or unloaded since its DTV was set up, the DTV is kept: the dynamic TLS
+ * blocks are released, and the static TLS is copied again from the
+ * initialization images. Otherwise, the dynamic linker sets the block
+ * up from scratch. Returns NULL on failure, in which case the block
+ * is lost, since its old TLS is gone. */
+static void*
+tls_reinit (void *tcb)
+{
+  dtv_t *dtv = ((tcbhead_t *)tcb)->dtv;
+  unsigned long long loads = 0;
+  int same;
+
+  dl_iterate_phdr (tls_loads_cb, &loads);
+  lll_lock (&tls_gen_lock, 0);
+  same = loads == tls_loads && dtv[0].counter == tls_generation;
+  lll_unlock (&tls_gen_lock, 0);
+
+#ifdef CLEAR_TCB
+  CLEAR_TCB (tcb);
+#endif
+
+  if (!same)
+    {
+      _dl_deallocate_tls (tcb, false);
+      if ((tcb = _dl_allocate_tls (tcb)) != NULL)
+        {
+          lll_lock (&tls_gen_lock, 0);
+          tls_loads = loads;
+          tls_generation = ((tcbhead_t *)tcb)->dtv[0].counter;
+          lll_unlock (&tls_gen_lock, 0);
+        }
+
+      return (tcb);
+    }
+
+  for (size_t i = 1; i <= dtv[-1].counter; ++i)
+    if (!dtv[i].pointer.is_static &&
+        dtv[i].pointer.val != TLS_DTV_UNALLOCATED)
+      free (dtv[i].pointer.val);
+
+  memset (dtv, 0, (dtv[-1].counter + 1) * sizeof (*dtv));
+  return (_dl_allocate_tls_init (tcb));
+}
+
+static void*
+tls_cache_get (void)
+{
+  void *tcb = tls_cache_take ();
+  if (tcb != NULL)
+    atomic_store (&tls_cache_hits, 1);
+
+  return (tcb);
+}
+
+/* Reserve a slot in the cache. Returns zero if it's full. */
+static int
+tls_cache_reserve (void)
+{
+  if (atomic_add (&tls_cache_cnt, 1) < TLS_CACHE_MAX)
+    return (1);
+
+  atomic_add (&tls_cache_cnt, -1);
+  return (0);
+}
+
+/* Release half of the cached blocks, if the cache hasn't
+ * been of any use since the last time it was trimmed. */
+static void
+tls_cache_trim (void)
+{
+  if (atomic_swap (&tls_cache_hits, 0) != 0)
+    return;
+
+  for (unsigned int n = atomic_load (&tls_cache_cnt) / 2; n > 0; --n)
+    {
+      void *tcb = tls_cache_take ();
+      if (tcb == NULL)
+        break;
+
+      _dl_deallocate_tls (tcb, true);
+    }
+}
+
+/* Store TCB in the cache, after reserving a slot for it. Since every
+ * block in the cache, or about to be, has a reservation, there's
+ * always a free slot for it. */
+static void
+tls_cache_put (void *tcb)
+{
+  while (1)
+    for (int i = 0; i < TLS_CACHE_MAX; ++i)
+      if (atomic_load (&tls_cache[i]) == NULL &&
+          atomic_cas_bool (&tls_cache[i], (void *)NULL, tcb))
+        {
+          if (atomic_add (&tls_cache_puts, 1) % TLS_CACHE_TRIM ==
+              TLS_CACHE_TRIM - 1)
+            tls_cache_trim ();
 
-/* Free list of TCB heads. */
-static void *tls_list;
+          return;
+        }
+}
 
 static int
 alloc_tls (struct pthread *pt, mach_port_t ktid)
 {
-  while (1)
+  /* A descriptor taken from the stack cache may still hold
+   * the TCB of its previous owner. Reuse it in that case. */
+  void *mem = pt->tcb != NULL ? pt->tcb : tls_cache_get ();
+  if (!(pt->tcb = mem != NULL ? tls_reinit (mem) : _dl_allocate_tls (NULL)))
+    return (-1);
+
+  /* Link the TCB and thread descriptor together. */
+  SETUP_TCB (pt->tcb, pt, ktid);
+  return (0);
+}
+
+/* Release the TCB of PT, if it still has one. Must not be called
+ * by the thread that owns it, since it's still in use until the
+ * thread is dead. */
+static void
+dealloc_tls (struct pthread *pt)
+{
+  if (pt->tcb == NULL)
+    return;
+  else if (!tls_cache_reserve ())
+    /* Release the whole block. */
+    _dl_deallocate_tls (pt->tcb, true);
+  else
+    tls_cache_put (pt->tcb);
+
+  pt->tcb = NULL;
+}
+
+#undef internal_function
+
+static inline size_t
+roundup_page (size_t size)
+{
+  return ((size + vm_page_size - 1) & ~(vm_page_size - 1));
+}
+
+/* The resolver state of the stacks we map gets its own pages, on top
+ * of the requested stack size, which the kernel only provides once the
+ * resolver touches them. Its first cache line is left in the page that
+ * holds the descriptor, though. Any use of the resolver sets the options
+ * or name server count, which live there, so a reused stack only needs
+ * its state cleared if they show that the previous owner used it. */
+#define RES_HEAD   64
+
+_Static_assert (offsetof (struct __res_state, nscount) + sizeof (int) <=
+  RES_HEAD, "resolver options must fit in the first line");
+
+/* Size of the resolver pages on top of the stacks we map. */
+static inline size_t
+res_pages (void)
+{
+  return (roundup_page (sizeof (struct __res_state) - RES_HEAD));
+}
+
+/* Size of the resolver state above the descriptor. User stacks are
+ * assumed to be already populated, so it's kept compact in that case. */
+static inline size_t
+res_size (int usr_stack)
+{
+  if (!usr_stack)
+    return (res_pages () + RES_HEAD);
+
+  return ((sizeof (struct __res_state) + __alignof__ (struct pthread) - 1) &
+    ~(__alignof__ (struct pthread) - 1));
+}
+
+/* Clear the resolver state at RESP, in a stack we mapped,
+ * if the previous owner of the stack used it. */
+static inline void
+res_clear (struct __res_state *resp)
+{
+  static const char zero[RES_HEAD];
+  if (memcmp (resp, zero, RES_HEAD) != 0)
+    memset (resp, 0, sizeof (*resp));
+}
+
+/* Thread ID's.
+ *
+ * The ID's of exited threads are recycled, so that the ID's of live
+ * threads are always unique, no matter how many threads have been
+ * created. ID's that have never been used are handed out by bumping
+ * __pthread_id_counter, which can't reach PTHREAD_ID_MASK before the
+ * address space is exhausted.
+ *
+ * An ID is only released once the kernel has cleared it in the dead
+ * thread's descriptor, which is when whoever reclaims the descriptor
+ * finds out that the thread is gone. Released ID's go through a FIFO
+ * queue, and are only reused once ID_QUARANTINE others have been
+ * released after them, so that the locks a thread left behind aren't
+ * immediately inherited by the next one to be created.
+ *
+ * The queue is linked through a table indexed by ID, made of blocks whose
+ * sizes double. Block number B holds ID_BLKSIZE << B links, and starts at
+ * ID (ID_BLKSIZE << B) - ID_BLKSIZE. Blocks are installed atomically and
+ * never go away. */
+
+#define ID_BLKSIZE   512
+#define ID_NBLOCKS   20
+
+#define ID_QUARANTINE   256
+
+static unsigned int id_links[ID_BLKSIZE];
+static unsigned int *id_blocks[ID_NBLOCKS];
+
+static inline unsigned int
+id_block (unsigned int id)
+{
+  return (31 - __builtin_clz (id + ID_BLKSIZE) - __builtin_ctz (ID_BLKSIZE));
+}
+
+/* Return the link for ID. If ALLOC is true, allocate its block if
+ * needed; otherwise, the block must exist. */
+static unsigned int*
+id_link (unsigned int id, int alloc)
+{
+  if (__glibc_likely (id < ID_BLKSIZE))
+    return (&id_links[id]);
+
+  unsigned int blk = id_block (id);
+  unsigned int *bp = atomic_load (&id_blocks[blk - 1]);
+
+  if (bp == NULL && alloc)
+    {
+      bp = (unsigned int *)malloc ((ID_BLKSIZE << blk) * sizeof (*bp));
+      if (bp == NULL)
+        return (NULL);
+      else if (!atomic_cas_bool (&id_blocks[blk - 1],
+          (unsigned int *)NULL, bp))
+        {
+          /* Someone else beat us to it. */
+          free (bp);
+          bp = id_blocks[blk - 1];
+        }
+    }
+
+  return (bp + id + ID_BLKSIZE - (ID_BLKSIZE << blk));
+}
+
+/* Get an ID that no other live thread is using. */
+static unsigned int
+id_alloc (void)
+{
+  struct pthread_id_queue *qp = &__pthread_id_free;
+  unsigned int id = 0;
+
+  if (atomic_load (&qp->count) > ID_QUARANTINE)
+    {
+      lll_lock (&qp->lock, 0);
+      if (qp->count > ID_QUARANTINE)
+        {
+          id = qp->head;
+          if ((qp->head = *id_link (id, 0)) == 0)
+            qp->tail = 0;
+
+          atomic_store (&qp->count, qp->count - 1);
+        }
+
+      lll_unlock (&qp->lock, 0);
+    }
+
+  if (id == 0)
+    id = (atomic_add (&__pthread_id_counter, 1) + 1) & PTHREAD_ID_MASK;
+
+  return (id);
+}
+
+/* Make the ID of the dead thread PT available for new threads. */
+static void
+id_release (struct pthread *pt)
+{
+  struct pthread_id_queue *qp = &__pthread_id_free;
+  unsigned int id = pt->dead_id;
+
+  if (id == 0)
+    return;
+
+  pt->dead_id = 0;
+  unsigned int *linkp = id_link (id, 1);
+  if (linkp == NULL)
+    /* We can't recycle it, so just let it go. */
+    return;
+
+  *linkp = 0;
+  lll_lock (&qp->lock, 0);
+  if (qp->tail != 0)
+    *id_link (qp->tail, 0) = id;
+  else
+    qp->head = id;
+
+  qp->tail = id;
+  atomic_store (&qp->count, qp->count + 1);
+  lll_unlock (&qp->lock, 0);
+}
+
+/* Stack arenas.
+ *
+ * Stacks are carved out of large mappings, each divided into slots of
+ * a single size, guard included. The arenas with a given slot size make
+ * up a class, with a lock of its own. The first arena of a class has
+ * ARENA_MIN_SLOTS slots, and every new one twice as many as the last,
+ * up to ARENA_MAX_SLOTS, so that a handful of arenas is enough for most
+ * programs. Arenas never grow past ARENA_MAX_SIZE bytes, though, and
+ * shrink down to a single slot when the address space is too crowded
+ * for them, so that a thread can be created whenever a mapping for its
+ * stack alone could have been. Creating a thread takes
+ * a slot from the free list of an arena, and a fork child can release
+ * every stack but its own with a couple of calls per arena. Released
+ * slots keep their memory until the whole arena is unused, at which
+ * point it's unmapped, unless it's the only arena in its class.
+ *
+ * Descriptors point to the arena holding their stack, so releasing
+ * a stack never has to look for it.
+ *
+ * Detached threads can't release their slot while still running on
+ * it, so they move it to a list of dying slots instead. Such slots are
+ * reclaimed once the kernel has cleared the thread's ID. */
+
+#define ARENA_MIN_SLOTS   8
+#define ARENA_MAX_SLOTS   1024
+
+/* Arenas are kept below this size, no matter how many slots that
+ * leaves them with, so that large stacks don't exhaust the address
+ * space in a few arenas. */
+#define ARENA_MAX_SIZE   (64UL << 20)
+
+/* End of a slot list. */
+#define ARENA_NIL   (~0U)
+
+struct arena_slot
+{
+  /* Next slot in the free or dying list. */
+  unsigned int next;
+  /* Set once the guard is in place, and once the slot has been used. */
+  unsigned char guarded;
+  unsigned char dirty;
+  /* Descriptor of the thread, for dying slots. */
+  struct pthread *dead;
+};
+
+struct arena_class;
+
+struct stack_arena
+{
+  struct stack_arena *next;
+  struct arena_class *cls;
+  vm_address_t base;
+  unsigned int nslots;
+  unsigned int nused;
+  /* Lists of free and dying slots. */
+  unsigned int free;
+  unsigned int dying;
+  struct arena_slot slots[];
+};
+
+struct arena_class
+{
+  struct arena_class *next;
+  size_t slotsize;
+  size_t guardsize;
+  unsigned int lock;
+  /* Number of slots for the next arena in the class. */
+  unsigned int nslots;
+  struct stack_arena *arenas;
+};
+
+/* Classes are never removed, so they can be looked up without
+ * a lock. The lock only serializes the creation of new ones. */
+static struct arena_class *arena_classes;
+static unsigned int arena_class_lock;
+
+/* Find the class for slots of SLOTSIZE bytes, with a guard
+ * of GUARDSIZE bytes, creating it if needed. */
+static struct arena_class*
+arena_class_get (size_t slotsize, size_t guardsize)
+{
+  struct arena_class *cp;
+
+  for (cp = atomic_load (&arena_classes); cp != NULL; cp = cp->next)
+    if (cp->slotsize == slotsize && cp->guardsize == guardsize)
+      return (cp);
+
+  lll_lock (&arena_class_lock, 0);
+  for (cp = arena_classes; cp != NULL; cp = cp->next)
+    if (cp->slotsize == slotsize && cp->guardsize == guardsize)
+      break;
+
+  if (cp == NULL && (cp = (struct arena_class *)malloc (sizeof (*cp))))
+    {
+      cp->slotsize = slotsize;
+      cp->guardsize = guardsize;
+      cp->lock = 0;
+      cp->nslots = ARENA_MIN_SLOTS;
+      cp->arenas = NULL;
+      cp->next = arena_classes;
+      atomic_store (&arena_classes, cp);
+    }
+
+  lll_unlock (&arena_class_lock, 0);
+  return (cp);
+}
+
+/* Reclaim the dying slots in AP whose threads are gone. */
+static void
+arena_reap (struct stack_arena *ap)
+{
+  unsigned int *prevp = &ap->dying;
+  while (*prevp != ARENA_NIL)
+    {
+      unsigned int i = *prevp;
+      struct arena_slot *sp = &ap->slots[i];
+
+      if (atomic_load (&sp->dead->id) != 0)
+        {
+          prevp = &sp->next;
+          continue;
+        }
+
+      *prevp = sp->next;
+      sp->next = ap->free;
+      ap->free = i;
+      --ap->nused;
+      id_release (sp->dead);
+      dealloc_tls (sp->dead);
+    }
+}
+
+/* Map a new arena for class CP. If the address space can't fit
+ * an arena as large as planned, fall back to smaller ones, down to
+ * a single slot. */
+static struct stack_arena*
+arena_create (struct arena_class *cp)
+{
+  unsigned int nslots = cp->nslots;
+  if (nslots > ARENA_MAX_SIZE / cp->slotsize)
+    nslots = ARENA_MAX_SIZE / cp->slotsize ?: 1;
+
+  struct stack_arena *ap = (struct stack_arena *)malloc (sizeof (*ap) +
+    nslots * sizeof (ap->slots[0]));
+
+  if (ap == NULL)
+    return (NULL);
+
+  while (1)
+    {
+      ap->base = 0;
+      if (vm_map (mach_task_self (), &ap->base, cp->slotsize * nslots, 0,
+          1, MEMORY_OBJECT_NULL, 0, 0, VM_PROT_DEFAULT,
+          PTHREAD_MPROT, VM_INHERIT_DEFAULT) == 0)
+        break;
+      else if (nslots == 1)
+        {
+          free (ap);
+          return (NULL);
+        }
+
+      /* Don't plan for more than what fits next time either. */
+      cp->nslots = nslots /= 2;
+    }
+
+  ap->cls = cp;
+  ap->nslots = nslots;
+  ap->nused = 0;
+  ap->free = 0;
+  ap->dying = ARENA_NIL;
+
+  for (unsigned int i = 0; i < nslots; ++i)
+    {
+      ap->slots[i].next = i + 1 < nslots ? i + 1 : ARENA_NIL;
+      ap->slots[i].guarded = ap->slots[i].dirty = 0;
+    }
+
+  return (ap);
+}
+
+/* Get a stack of SIZE bytes, with a guard of GUARDSIZE bytes below it.
+ * Returns the top of the stack, or NULL on failure. The arena is
+ * stored in *ARENAP, and *DIRTYP is set to nonzero if the slot had
+ * been used before, and thus isn't zero-filled. */
+static void*
+arena_alloc (size_t size, size_t guardsize,
+  struct stack_arena **arenap, int *dirtyp)
+{
+  struct arena_class *cp = arena_class_get (size + guardsize, guardsize);
+  struct stack_arena *ap;
+
+  if (cp == NULL)
+    return (NULL);
+
+  lll_lock (&cp->lock, 0);
+  for (ap = cp->arenas; ap != NULL; ap = ap->next)
+    {
+      if (ap->free == ARENA_NIL && ap->dying != ARENA_NIL)
+        arena_reap (ap);
+
+      if (ap->free != ARENA_NIL)
+        break;
+    }
+
+  if (ap == NULL)
+    {
+      /* Every arena is full. Map a larger one, and put
+       * it first, since it has the most free slots. */
+      if ((ap = arena_create (cp)) == NULL)
+        {
+          lll_unlock (&cp->lock, 0);
+          return (NULL);
+        }
+
+      if (cp->nslots < ARENA_MAX_SLOTS &&
+          cp->nslots < ARENA_MAX_SIZE / cp->slotsize)
+        cp->nslots *= 2;
+
+      ap->next = cp->arenas;
+      cp->arenas = ap;
+    }
+
+  unsigned int i = ap->free;
+  struct arena_slot *sp = &ap->slots[i];
+  vm_address_t lo = ap->base + i * cp->slotsize;
+
+  /* Guards stay in place once set up, so this is only
+   * done the first time a slot is used. */
+  if (guardsize != 0 && !sp->guarded)
+    {
+      if (vm_protect (mach_task_self (), lo, guardsize, 1, 0) != 0)
+        {
+          lll_unlock (&cp->lock, 0);
+          return (NULL);
+        }
+
+      sp->guarded = 1;
+    }
+
+  ap->free = sp->next;
+  ++ap->nused;
+  *dirtyp = sp->dirty;
+  sp->dirty = 1;
+  lll_unlock (&cp->lock, 0);
+
+  *arenap = ap;
+  return ((void *)(lo + cp->slotsize));
+}
+
+/* Release the slot holding the stack of PT. If DYING is true, the
+ * thread is still running on it, and the slot is only reclaimed once
+ * the thread is dead. Returns zero if the stack isn't in an arena. */
+static int
+arena_free (struct pthread *pt, int dying)
+{
+  struct stack_arena *ap = pt->arena;
+  if (ap == NULL)
+    return (0);
+
+  struct arena_class *cp = ap->cls;
+  vm_address_t addr = (vm_address_t)pt->stack - pt->guardsize;
+  unsigned int i = (addr - ap->base) / cp->slotsize;
+  struct arena_slot *sp = &ap->slots[i];
+
+  lll_lock (&cp->lock, 0);
+  if (dying)
+    {
+      sp->dead = pt;
+      sp->next = ap->dying;
+      ap->dying = i;
+      ap = NULL;
+    }
+  else
+    {
+      sp->next = ap->free;
+      ap->free = i;
+      if (--ap->nused != 0 || (cp->arenas == ap && ap->next == NULL))
+        ap = NULL;
+      else
+        {
+          /* The arena is empty, and there are others to fall back
+           * on. Unlink it and return it to the system. */
+          struct stack_arena **prevp = &cp->arenas;
+          while (*prevp != ap)
+            prevp = &(*prevp)->next;
+
+          *prevp = ap->next;
+        }
+    }
+
+  lll_unlock (&cp->lock, 0);
+
+  if (ap != NULL)
+    {
+      vm_deallocate (mach_task_self (), ap->base, cp->slotsize * ap->nslots);
+      free (ap);
+    }
+
+  return (1);
+}
+
+/* Release every arena, except for the slot holding the stack of SELF.
+ * Only called in a fork child, where the other threads are gone. The
+ * arena of SELF is shrunk down to that single slot, which is released
+ * along with it when the thread exits. */
+static void
+arena_flush (struct pthread *self)
+{
+  struct stack_arena *own = self->arena;
+
+  for (struct arena_class *cp = arena_classes; cp != NULL; cp = cp->next)
+    {
+      struct stack_arena *ap = cp->arenas;
+      while (ap != NULL)
+        {
+          struct stack_arena *next = ap->next;
+          vm_address_t end = ap->base + cp->slotsize * ap->nslots;
+
+          if (ap != own)
+            {
+              vm_deallocate (mach_task_self (), ap->base, end - ap->base);
+              free (ap);
+            }
+          else
+            {
+              vm_address_t lo = (vm_address_t)self->stack - self->guardsize;
+              struct arena_slot *sp =
+                &ap->slots[(lo - ap->base) / cp->slotsize];
+
+              vm_deallocate (mach_task_self (), ap->base, lo - ap->base);
+              vm_deallocate (mach_task_self (), lo + cp->slotsize,
+                end - lo - cp->slotsize);
+
+              ap->slots[0] = *sp;
+              ap->base = lo;
+              ap->nslots = ap->nused = 1;
+              ap->free = ap->dying = ARENA_NIL;
+            }
+
+          ap = next;
+        }
+
+      cp->arenas = NULL;
+      cp->lock = 0;
+      cp->nslots = ARENA_MIN_SLOTS;
+    }
+
+  if (own != NULL)
+    {
+      own->next = NULL;
+      own->cls->arenas = own;
+    }
+
+  arena_class_lock = 0;
+}
+
+/* Release the TCB's of the threads in dying slots. Only called
+ * in a fork child, where the threads are gone. */
+static void
+arena_flush_dead (void)
+{
+  for (struct arena_class *cp = arena_classes; cp != NULL; cp = cp->next)
+    for (struct stack_arena *ap = cp->arenas; ap != NULL; ap = ap->next)
+      for (unsigned int i = ap->dying; i != ARENA_NIL; i = ap->slots[i].next)
+        dealloc_tls (ap->slots[i].dead);
+}
+
+static inline void
+free_stack (struct pthread *pt)
+{
+  if ((pt->flags & PT_FLG_USR_STACK) || arena_free (pt, 0))
+    return;
+
+  size_t total = pt->stacksize + pt->guardsize + res_pages ();
+  vm_offset_t addr = (vm_offset_t)pt->stack - pt->guardsize;
+  vm_deallocate (mach_task_self (), addr, total);
+}
+
+/* Release the stack of PT in a fork child. Stacks in an arena are
+ * left alone, since the arenas are released as a whole. */
+static void
+free_stack_child (struct pthread *pt)
+{
+  if (!(pt->flags & PT_FLG_USR_STACK) && pt->arena == NULL)
+    free_stack (pt);
+}
+
+/* Stack cache.
+ *
+ * The stacks of terminated threads, along with the descriptors at their
+ * top, are kept in a few buckets, each holding stacks of a single size,
+ * so that creating a thread doesn't need any VM calls in the common case.
+ * Detached threads cache their stacks themselves while still running on
+ * them; the kernel clears their ID once they're dead, and the stacks are
+ * not reused until then. The cache is bounded in size, and stacks that
+ * don't fit in it are released as usual.
+ *
+ * So that a burst of threads doesn't pin the whole cache for good, the
+ * entries are trimmed each time a stack is cached: once the cache is
+ * over its low watermark, the entries that have gone unused while
+ * STACK_CACHE_AGE others were cached are returned to the system, and
+ * when it's full, the oldest are released to make room for the new one.
+ * Only entries of threads that are known to be dead can be released. */
+
+#define STACK_CACHE_NBUCKETS   4
+#define STACK_CACHE_MAX        (32 * 1024 * 1024)
+#define STACK_CACHE_LOW        (STACK_CACHE_MAX / 4)
+#define STACK_CACHE_AGE        64
+
+struct stack_bucket
+{
+  size_t stacksize;
+  size_t guardsize;
+  unsigned int count;
+  struct hurd_list list;
+};
+
+static struct stack_bucket stack_cache[STACK_CACHE_NBUCKETS];
+static size_t stack_cache_total;
+static unsigned int stack_cache_clock;
+static unsigned int stack_cache_lock;
+
+/* Take a cached stack of SIZE bytes with a guard of GUARDSIZE bytes. */
+static struct pthread*
+stack_cache_get (size_t size, size_t guardsize)
+{
+  struct pthread *pt = NULL;
+
+  lll_lock (&stack_cache_lock, 0);
+  for (int i = 0; i < STACK_CACHE_NBUCKETS; ++i)
+    {
+      struct stack_bucket *bp = &stack_cache[i];
+      if (bp->count == 0 || bp->stacksize != size ||
+          bp->guardsize != guardsize)
+        continue;
+
+      /* Take the oldest entry, which is the most likely to belong
+       * to a thread that is completely dead by now. */
+      pt = hurd_list_entry (bp->list.prev, struct pthread, link);
+      hurd_list_del (&pt->link);
+      --bp->count;
+      stack_cache_total -= size + guardsize;
+      break;
+    }
+
+  lll_unlock (&stack_cache_lock, 0);
+
+  if (pt != NULL)
+    {
+      unsigned int id;
+      while ((id = atomic_load (&pt->id)) != 0)
+        lll_wait (&pt->id, id, 0);
+
+      id_release (pt);
+    }
+
+  return (pt);
+}
+
+/* Move the entries that have to go to VICTIMS, oldest first, until
+ * NEED more bytes fit in the cache and what's left is either under the
+ * low watermark or recent enough. Must be called with the lock held. */
+static void
+stack_cache_trim (size_t need, struct hurd_list *victims)
+{
+  while (1)
+    {
+      struct stack_bucket *bp = NULL;
+      struct pthread *pt = NULL;
+
+      for (int i = 0; i < STACK_CACHE_NBUCKETS; ++i)
+        {
+          if (stack_cache[i].count == 0)
+            continue;
+
+          struct pthread *tmp = hurd_list_entry (stack_cache[i].list.prev,
+            struct pthread, link);
+          if (pt == NULL || stack_cache_clock - tmp->cache_tick >
+              stack_cache_clock - pt->cache_tick)
+            {
+              bp = &stack_cache[i];
+              pt = tmp;
+            }
+        }
+
+      if (pt == NULL || atomic_load (&pt->id) != 0 ||
+          (stack_cache_total + need <= STACK_CACHE_MAX &&
+            (stack_cache_total <= STACK_CACHE_LOW ||
+              stack_cache_clock - pt->cache_tick < STACK_CACHE_AGE)))
+        break;
+
+      hurd_list_del (&pt->link);
+      hurd_list_add_tail (victims, &pt->link);
+      --bp->count;
+      stack_cache_total -= bp->stacksize + bp->guardsize;
+    }
+}
+
+/* Release the stacks and TCB's of the entries in VICTIMS. */
+static void
+stack_cache_release (struct hurd_list *victims)
+{
+  while (!hurd_list_empty_p (victims))
+    {
+      struct pthread *pt =
+        hurd_list_entry (victims->next, struct pthread, link);
+
+      hurd_list_del (&pt->link);
+      id_release (pt);
+      dealloc_tls (pt);
+      free_stack (pt);
+    }
+}
+
+/* Try to cache the stack of PT. Returns zero if there is no room. */
+static int
+stack_cache_put (struct pthread *pt)
+{
+  size_t total = pt->stacksize + pt->guardsize;
+  struct stack_bucket *bp = NULL, *freep = NULL;
+  struct hurd_list victims;
+
+  hurd_list_init (&victims);
+  lll_lock (&stack_cache_lock, 0);
+  stack_cache_trim (total, &victims);
+  if (stack_cache_total + total <= STACK_CACHE_MAX)
+    for (int i = 0; i < STACK_CACHE_NBUCKETS; ++i)
+      {
+        struct stack_bucket *tmp = &stack_cache[i];
+        if (tmp->count == 0)
+          {
+            if (freep == NULL)
+              freep = tmp;
+          }
+        else if (tmp->stacksize == pt->stacksize &&
+            tmp->guardsize == pt->guardsize)
+          {
+            bp = tmp;
+            break;
+          }
+      }
+
+  if (bp == NULL && (bp = freep) != NULL)
+    {
+      /* Claim an empty bucket for this size. */
+      bp->stacksize = pt->stacksize;
+      bp->guardsize = pt->guardsize;
+      hurd_list_init (&bp->list);
+    }
+
+  if (bp != NULL)
+    {
+      pt->cache_tick = ++stack_cache_clock;
+      hurd_list_add_head (&bp->list, &pt->link);
+      ++bp->count;
+      stack_cache_total += total;
+    }
+
+  lll_unlock (&stack_cache_lock, 0);
+  stack_cache_release (&victims);
+  return (bp != NULL);
+}
+
+/* Release every stack in the cache. Only called in a fork child,
+ * where the threads that cached them are gone. */
+static void
+stack_cache_flush (void)
+{
+  for (int i = 0; i < STACK_CACHE_NBUCKETS; ++i)
+    {
+      struct stack_bucket *bp = &stack_cache[i];
+      while (bp->count != 0)
+        {
+          struct pthread *pt =
+            hurd_list_entry (bp->list.next, struct pthread, link);
+
+          hurd_list_del (&pt->link);
+          --bp->count;
+          dealloc_tls (pt);
+          free_stack_child (pt);
+        }
+    }
+
+  stack_cache_total = 0;
+  stack_cache_lock = 0;
+}
+
+/* Detached threads running on a user stack have nowhere to leave their
+ * descriptor, and thus their TCB, so they add it to this list on exit.
+ * Each of them releases the TCB's of the threads in the list that are
+ * dead by then. As in other implementations, this assumes that a user
+ * stack isn't released while its detached thread may still run. */
+static HURD_LIST_DECL (dead_threads);
+static unsigned int dead_threads_lock;
+
+/* Add PT, which is exiting, to the list of dead threads. */
+static void
+dead_threads_add (struct pthread *pt)
+{
+  lll_lock (&dead_threads_lock, 0);
+  struct hurd_list *runp = dead_threads.next;
+
+  while (!hurd_list_end_p (&dead_threads, runp))
+    {
+      struct pthread *tmp = hurd_list_entry (runp, struct pthread, link);
+      runp = runp->next;
+
+      if (atomic_load (&tmp->id) == 0)
+        {
+          hurd_list_del (&tmp->link);
+          id_release (tmp);
+          dealloc_tls (tmp);
+        }
+    }
+
+  hurd_list_add_tail (&dead_threads, &pt->link);
+  lll_unlock (&dead_threads_lock, 0);
+}
+
+/* Release the TCB's of the threads in the list. Only called
+ * in a fork child, where the threads are gone. */
+static void
+dead_threads_flush (void)
+{
+  while (!hurd_list_empty_p (&dead_threads))
     {
-      if ((pt->tcb = tls_list) == NULL)
-        break;
+      struct pthread *pt =
+        hurd_list_entry (dead_threads.next, struct pthread, link);
 
-      void *next = *(void **)pt->tcb;
-      if (atomic_cas_bool (&tls_list, pt->tcb, next))
-        break;
+      hurd_list_del (&pt->link);
+      dealloc_tls (pt);
     }
 
-  if (!(pt->tcb = _dl_allocate_tls (pt->tcb)))
-    return (-1);
+  dead_threads_lock = 0;
+}
 
-  /* Link the TCB and thread descriptor together. */
-  SETUP_TCB (pt->tcb, pt, ktid);
-  return (0);
+/* Reset the descriptor PT, taken from the cache. Thread exit has
+ * already cleared the thread-specific data, so only the fields left
+ * over by the previous owner need to be reset. */
+static void
+pt_reset (struct pthread *pt)
+{
+  pt->cleanup = NULL;
+  pt->flags = 0;
+  pt->joinpt = NULL;
+  pt->retval = NULL;
+  res_clear (pt->resp);
+}
+
+/* The stacks we map all start at a page boundary, which would put every
+ * descriptor, and the first frames of every thread, in the same cache
+ * sets. To avoid that, descriptors are placed a different number of
+ * cache lines below the top of each stack, in a round-robin fashion.
+ * The initial stack pointer sits right below the descriptor, so it
+ * gets the same treatment. */
+#define PT_NCOLORS       32
+#define PT_COLOR_SIZE    64
+
+static unsigned int pt_color;
+
+/* Place the thread descriptor at the top of STACK,
+ * below the resolver state. */
+static inline struct pthread*
+pt_place (void *stack, int usr_stack)
+{
+  unsigned long top = (unsigned long)stack - res_size (usr_stack);
+  if (!usr_stack)
+    top -= (atomic_add (&pt_color, 1) % PT_NCOLORS) * PT_COLOR_SIZE;
+
+  return ((struct pthread *)
+    ((top - sizeof (struct pthread)) & ~(__alignof__ (struct pthread) - 1)));
+}
+
+/* Set up the descriptor PT, placed at the top of STACK, with a kernel
+ * thread, signal state and TCB. On failure, the stack is released. */
+static struct pthread*
+pt_setup (struct pthread *pt, void *stack, size_t size,
+  size_t guardsize, const pthread_attr_t *attrp)
+{
+  int usr_stack = pt->flags & PT_FLG_USR_STACK;
+
+  pt->stack = (char *)stack - (usr_stack ? 0 : res_pages ()) -
+    (pt->stacksize = size);
+  pt->guardsize = guardsize;
+  pt->resp = (struct __res_state *)((char *)stack - res_size (usr_stack));
+
+  /* Temporarily set the ID to an invalid value. The thread itself
+   * will create a valid one once it begins executing. */
+  pt->id = PTHREAD_INVALID_ID;
+
+  pt->specific[0] = pt->specific_blk1;
+
+  if (attrp->__flags & PTHREAD_CREATE_DETACHED)
+    pt->joinpt = pt;
+
+  mach_port_t ktid;
+  struct hurd_sigstate *stp;
+
+  if (thread_create (mach_task_self (), &ktid) != 0)
+    goto fail_kthread;
+  else if (!(stp = _hurd_thread_sigstate (ktid)))
+    goto fail_sigstate;
+  else if (alloc_tls (pt, ktid) < 0)
+    goto fail_tls;
+
+  __pthread_sigstate (pt) = stp;
+  return (pt);
+
+fail_tls:
+  _hurd_sigstate_delete (ktid);
+
+fail_sigstate:
+  thread_terminate (ktid);
+
+fail_kthread:
+  free_stack (pt);
+
+  return (NULL);
 }
 
+/* Destroy PT, which was set up but never ran. */
 static void
-dealloc_tls (struct pthread *pt)
+pt_destroy (struct pthread *pt)
 {
-  _dl_deallocate_tls (pt->tcb, false);
-#ifdef CLEAR_TCB
-  CLEAR_TCB (pt->tcb);
-#endif
-  while (1)
-    {
-      void *tmp = tls_list;
-      *(void **)pt->tcb = tmp;
-      if (atomic_cas_bool (&tls_list, tmp, pt->tcb))
-        break;
-    }
+  mach_port_t ktid = __pthread_kport (pt);
+  _hurd_sigstate_delete (ktid);
+  dealloc_tls (pt);
+  thread_terminate (ktid);
 
-  pt->tcb = NULL;
+  /* The stack is the last thing to clean up. */
+  free_stack (pt);
 }
 
-#undef internal_function
+/* Number of consecutive clean pages that end a stack scan. A single
+ * one isn't enough, since a frame may have a page-sized local that's
+ * all zeroes. */
+#define STACK_SCAN_GAP   8
 
-static inline size_t
-roundup_page (size_t size)
+void* __pthread_stack_scan (void *lo, void *hi, void *floor, int clear)
 {
-  return ((size + vm_page_size - 1) & ~(vm_page_size - 1));
+  unsigned long start = (unsigned long)lo;
+  unsigned long end = (unsigned long)hi & ~(sizeof (long) - 1);
+  unsigned long low = end;
+  int nclean = 0;
+
+  while (end > start)
+    {
+      unsigned long pg = (end - 1) & ~(vm_page_size - 1);
+      if (pg < start)
+        pg = start;
+
+      const unsigned long *p = (const unsigned long *)pg;
+      while (p < (const unsigned long *)end && *p == 0)
+        ++p;
+
+      if (p != (const unsigned long *)end)
+        {
+          nclean = 0;
+          low = (unsigned long)p;
+          if (clear)
+            memset ((void *)p, 0, end - (unsigned long)p);
+        }
+      else if (pg < (unsigned long)floor && ++nclean == STACK_SCAN_GAP)
+        break;
+
+      end = pg;
+    }
+
+  return ((void *)low);
 }
 
-static inline void
-free_stack (struct pthread *pt)
+/* Zero the part of the stack between LO and HI that previous owners
+ * used, so that 'pthread_getstackusage_np' can tell how much the new
+ * one uses. Everything down to *MARKP, the lowest address any previous
+ * owner is known to have used, is visited. The mark is then updated
+ * with whatever was found below it. */
+static void
+stack_clean (void *lo, void *hi, void **markp)
 {
-  if (pt->flags & PT_FLG_USR_STACK)
-    return;
+  void *mark = *markp;
+  if (mark == NULL || mark < lo || mark > hi)
+    mark = hi;
 
-  size_t total = pt->stacksize + pt->guardsize;
-  vm_offset_t addr = (vm_offset_t)pt->stack - pt->guardsize;
-  vm_deallocate (mach_task_self (), addr, total);
+  void *low = __pthread_stack_scan (lo, hi, mark, 1);
+  *markp = low < mark ? low : mark;
 }
 
 /* XXX: This function assumes the stack always grows down. */
@@ -109,92 +1208,219 @@ pt_allocate (const pthread_attr_t *attrp)
   void *stack = attrp->__stack;
   size_t size = attrp->__stacksize ?: __pthread_dfl_attr.__stacksize;
   size_t guardsize = attrp->__guardsize;
+  struct pthread *pt;
+  struct stack_arena *arena = NULL;
+  int dirty = 1;
 
   if (__glibc_likely (stack == NULL))
     {
-      vm_address_t *outp = (vm_address_t *)&stack;
-
       /* Round stack size and guard size to a page. */
       size = roundup_page (size);
       if (guardsize != 0)
         guardsize = roundup_page (guardsize);
 
-      size_t total = size + guardsize;
-
-      if (vm_map (mach_task_self (), outp, total, 0,
-          1, MEMORY_OBJECT_NULL, 0, 0, VM_PROT_DEFAULT,
-          PTHREAD_MPROT, VM_INHERIT_DEFAULT) != 0)
+      if ((pt = stack_cache_get (size, guardsize)) != NULL)
+        {
+          pt_reset (pt);
+          stack_clean (pt->stack, pt, &pt->stack_mark);
+          return (pt_setup (pt, (char *)pt->stack + size + res_pages (),
+            size, guardsize, attrp));
+        }
+      else if ((stack = arena_alloc (size + res_pages (), guardsize,
+          &arena, &dirty)) == NULL)
         return (NULL);
+    }
 
-      if (guardsize != 0 && vm_protect (mach_task_self (),
-          *outp, guardsize, 1, 0) != 0)
+  int usr_stack = attrp->__stack != 0;
+  pt = pt_place (stack, usr_stack);
+  if (dirty)
+    {
+      /* Clear the descriptor, and the resolver state above it. */
+      struct __res_state *resp =
+        (struct __res_state *)((char *)stack - res_size (usr_stack));
+
+      /* The mark left by the slot's previous owner survives. */
+      void *mark = usr_stack ? NULL : pt->stack_mark;
+
+      memset (pt, 0, (char *)resp - (char *)pt);
+      if (usr_stack)
+        memset (resp, 0, sizeof (*resp));
+      else
         {
-          vm_deallocate (mach_task_self (), *outp, total);
-          return (NULL);
+          res_clear (resp);
+          stack_clean ((char *)stack - res_pages () - size, pt, &mark);
+          pt->stack_mark = mark;
         }
-
-      /* Set the pointer at the end. */
-      *outp += total;
     }
 
-  /* Place the thread descriptor at the top of the stack. */
-  struct pthread *pt = (struct pthread *)
-    (((unsigned long)stack - sizeof (*pt)) &
-      ~(__alignof__ (struct pthread) - 1));
+  if (usr_stack)
+    pt->flags |= PT_FLG_USR_STACK;
+
+  pt->arena = arena;
+
+  return (pt_setup (pt, stack, size, guardsize, attrp));
+}
+
+/* Allocate N descriptors for attributes ATTRP into PTS. Either all
+ * of them are allocated, or none are. */
+static int
+pt_allocate_n (const pthread_attr_t *attrp, struct pthread **pts,
+  unsigned int n)
+{
+  for (unsigned int i = 0; i < n; ++i)
+    if ((pts[i] = pt_allocate (attrp)) == NULL)
+      {
+        while (i > 0)
+          pt_destroy (pts[--i]);
+
+        return (EAGAIN);
+      }
+
+  return (0);
+}
+
+/* Touch the top BYTES of PT's stack, so that the new thread doesn't
+ * start out with a series of page faults. Only privileged tasks may
+ * wire memory in GNU Mach, so we have to fault in every page. The
+ * contents are left intact, since the stack may already be set up. */
+static void
+pt_prefault (struct pthread *pt, size_t bytes)
+{
+  unsigned long lo = (unsigned long)pt->stack;
+  unsigned long top = (unsigned long)pt;
 
-  if (attrp->__stack != 0)
+  if (bytes < top - lo)
+    lo = (top - bytes) & ~(vm_page_size - 1);
+
+  for (; lo < top; lo += vm_page_size)
     {
-      memset (pt, 0, sizeof (*pt));
-      pt->flags |= PT_FLG_USR_STACK;
+      volatile char *p = (volatile char *)lo;
+      *p = *p;
     }
+}
 
-  /* Initialize pthread descriptor. */
-  pt->stack = (char *)stack - (pt->stacksize = size);
-  pt->guardsize = guardsize;
-
-  /* Temporarily set the ID to an invalid value. The thread itself
-   * will create a valid one once it begins executing. */
-  pt->id = PTHREAD_INVALID_ID;
+static void thread_entry (struct pthread *);
 
-  pt->specific[0] = pt->specific_blk1;
+/* Thread pool.
+ *
+ * Setting up a thread takes about ten RPC's, so we keep a few threads
+ * with default attributes around, with their kernel thread, signal state
+ * and TCB ready, and their machine state already pointing at the entry
+ * point. Creating a thread from the pool only takes a 'thread_resume'.
+ * The pool is refilled by exiting threads, which keeps the setup cost
+ * away from the threads that create new ones. */
 
-  if (attrp->__flags & PTHREAD_CREATE_DETACHED)
-    pt->joinpt = pt;
+#define THREAD_POOL_MAX   4
 
-  mach_port_t ktid;
-  struct hurd_sigstate *stp;
+static struct pthread *thread_pool[THREAD_POOL_MAX];
+static unsigned int thread_pool_cnt;
+static unsigned int thread_pool_lock;
 
-  if (thread_create (mach_task_self (), &ktid) != 0)
-    goto fail_kthread;
-  else if (!(stp = _hurd_thread_sigstate (ktid)))
-    goto fail_sigstate;
-  else if (alloc_tls (pt, ktid) < 0)
-    goto fail_tls;
+/* Take a thread from the pool whose stack matches (if MATCH is true)
+ * or doesn't match (otherwise) the sizes in ATTRP. */
+static struct pthread*
+thread_pool_take (const pthread_attr_t *attrp, int match)
+{
+  size_t size = roundup_page (attrp->__stacksize ?:
+    __pthread_dfl_attr.__stacksize);
+  size_t guardsize = attrp->__guardsize ?
+    roundup_page (attrp->__guardsize) : 0;
+  struct pthread *pt = NULL;
+
+  lll_lock (&thread_pool_lock, 0);
+  for (unsigned int i = 0; i < thread_pool_cnt; ++i)
+    if ((thread_pool[i]->stacksize == size &&
+        thread_pool[i]->guardsize == guardsize) == match)
+      {
+        pt = thread_pool[i];
+        thread_pool[i] = thread_pool[--thread_pool_cnt];
+        break;
+      }
 
-  __pthread_sigstate (pt) = stp;
+  lll_unlock (&thread_pool_lock, 0);
   return (pt);
+}
 
-fail_tls:
-  _hurd_sigstate_delete (ktid);
+/* Take a thread from the pool that is suitable for attributes ATTRP. */
+static struct pthread*
+thread_pool_get (const pthread_attr_t *attrp)
+{
+  if (attrp->__stack != NULL || atomic_load (&thread_pool_cnt) == 0)
+    return (NULL);
 
-fail_sigstate:
-  thread_terminate (ktid);
+  return (thread_pool_take (attrp, 1));
+}
 
-fail_kthread:
-  free_stack (pt);
+/* Add a new thread to the pool, if there's room for it. */
+static void
+thread_pool_refill (void)
+{
+  struct pthread *pt;
 
-  return (NULL);
+  if (atomic_load (&thread_pool_cnt) >= THREAD_POOL_MAX)
+    {
+      /* The default attributes may have changed since the pool was
+       * filled. Make room by discarding a thread that's out of date. */
+      if ((pt = thread_pool_take (&__pthread_dfl_attr, 0)) == NULL)
+        return;
+
+      pt_destroy (pt);
+    }
+
+  pt = pt_allocate (&__pthread_dfl_attr);
+  if (pt == NULL)
+    return;
+
+  /* Pooled threads are handed out as they are, so they
+   * have to be prefaulted here, if at all. */
+  if (__pthread_dfl_attr.__prefault != 0)
+    pt_prefault (pt, __pthread_dfl_attr.__prefault);
+
+  if (__pthread_set_machine_state (pt, thread_entry) == 0)
+    {
+      lll_lock (&thread_pool_lock, 0);
+      if (thread_pool_cnt < THREAD_POOL_MAX)
+        {
+          thread_pool[thread_pool_cnt++] = pt;
+          pt = NULL;
+        }
+
+      lll_unlock (&thread_pool_lock, 0);
+      if (pt == NULL)
+        return;
+    }
+
+  /* Either we couldn't set up the thread, or someone else
+   * filled the pool in the meantime. */
+  pt_destroy (pt);
+}
+
+/* Release the threads in the pool. Only called in a fork child,
+ * where the kernel threads don't exist. */
+static void
+thread_pool_flush (void)
+{
+  for (unsigned int i = 0; i < thread_pool_cnt; ++i)
+    {
+      dealloc_tls (thread_pool[i]);
+      free_stack_child (thread_pool[i]);
+    }
+
+  thread_pool_cnt = 0;
+  thread_pool_lock = 0;
 }
 
 static void
 thread_entry (struct pthread *pt)
 {
-  /* Add ourselves to the list of running threads, and
-   * create a (sort of) unique id. */
-  lll_lock (&__running_threads_lock, 0);
-  hurd_list_add_tail (&__running_threads, &pt->link);
-  pt->id = ++__pthread_id_counter & PTHREAD_ID_MASK;
-  lll_unlock (&__running_threads_lock, 0);
+  /* Get a unique id, and add ourselves to the
+   * list of running threads it selects. */
+  pt->id = id_alloc ();
+
+  struct pthread_running_list *rlp = PTHREAD_RUNNING_LIST (pt);
+  lll_lock (&rlp->lock, 0);
+  hurd_list_add_tail (&rlp->list, &pt->link);
+  lll_unlock (&rlp->lock, 0);
 
   /* Initialize internal ctype structures. */
   extern void __ctype_init (void);
@@ -203,10 +1429,10 @@ thread_entry (struct pthread *pt)
   /* Set up thread-local resolver state. */
   extern __thread struct __res_state* __resp
     __attribute__ ((tls_model ("initial-exec")));
-  __resp = &pt->res_state;
+  __resp = pt->resp;
 
-  /* New threads should use the global locale. */
-  uselocale (LC_GLOBAL_LOCALE);
+  /* There's no need to switch to the global locale: ld.so initializes
+   * the TLS block with it, including for TCB's that are recycled. */
 
   /* Mark the thread as a possible receiver of global signals. */
   _hurd_sigstate_set_global_rcv (__pthread_sigstate (pt));
@@ -217,15 +1443,21 @@ thread_entry (struct pthread *pt)
 
 void __pthread_cleanup (struct pthread *pt)
 {
+  PTHREAD_FORK_FINISH ();
+
   int detached_p = DETACHED_P (pt);
   /* Make sure the local variable above is set before
    * marking the thread as in the 'exiting' state. */
   atomic_mfence ();
   atomic_or (&pt->flags, PT_FLG_EXITING);
 
-  lll_lock (&__running_threads_lock, 0);
+  /* Keys deleted from now on won't clear our slots. */
+  __pthread_save_fast_keys ();
+
+  struct pthread_running_list *rlp = PTHREAD_RUNNING_LIST (pt);
+  lll_lock (&rlp->lock, 0);
   hurd_list_del (&pt->link);
-  lll_unlock (&__running_threads_lock, 0);
+  lll_unlock (&rlp->lock, 0);
 
   /* Call destructors for thread-local variables. */
   extern void __call_tls_dtors (void);
@@ -243,49 +1475,47 @@ void __pthread_cleanup (struct pthread *pt)
   if (atomic_add (&__pthread_total, -1) == 1)
     exit (0);
 
-  /* We unconditionally destroy the kernel thread and reply port,
-   * but only free the stack if the pthread is detached and if
-   * the stack wasn't supplied by the user. */
+  /* Set up a thread for future creators, now that we're done. */
+  thread_pool_refill ();
+
+  /* We unconditionally destroy the kernel thread and reply port.
+   * Our stack and TCB are still in use until the kernel is done with
+   * us, so they're released by whoever finds out we're dead: either
+   * the thread that joins us or, if we're detached, the next user of
+   * our stack (or, for user stacks, the next detached thread to exit). */
   mach_port_t ktid = __pthread_kport (pt);
   mach_port_t rport = __mig_get_reply_port ();
-  vm_address_t stack = 0;
-  size_t size = 0;
-  vm_address_t death_ev = 0;
 
   _hurd_sigstate_delete (ktid);
   __pthread_sigstate(pt) = NULL;
 
-  if (!detached_p)
-    /* If the thread is joinable, ask the kernel to
-     * signal us once it's terminated. */
-    death_ev = (vm_address_t)&pt->id;
-  else if (!(pt->flags & PT_FLG_USR_STACK))
+  /* Our ID is released by whoever finds out that the kernel has
+   * cleared it, since until then, we're still using it. */
+  pt->dead_id = pt->id;
+
+  if (detached_p)
     {
-      size = pt->stacksize + pt->guardsize;
-      stack = (vm_address_t)pt->stack - pt->guardsize;
+      if (pt->flags & PT_FLG_USR_STACK)
+        dead_threads_add (pt);
+      else if (!stack_cache_put (pt))
+        arena_free (pt, 1);
     }
 
-  dealloc_tls (pt);
+  /* Ask the kernel to clear our ID and wake any waiters
+   * once we're terminated. */
   thread_terminate_release2 (ktid, mach_task_self (),
-    ktid, rport, stack, size, death_ev);
+    ktid, rport, 0, 0, (vm_address_t)&pt->id);
 }
 
-int pthread_create (pthread_t *ptp, const pthread_attr_t *attrp,
+/* Set the start routine and signal mask of the new thread PT. */
+static void
+pt_prepare (struct pthread *pt, struct pthread *parent,
   void* (*start_fct) (void *), void *argp)
 {
-  if (!attrp)
-    attrp = &__pthread_dfl_attr;
-
-  struct pthread *pt = pt_allocate (attrp);
-
-  if (!pt)
-    return (EAGAIN);
-
   pt->start_fct = start_fct;
   pt->argp = argp;
 
   /* Copy the signal mask from the parent thread, as per POSIX. */
-  struct pthread *parent = PTHREAD_SELF;
   if (parent != NULL && __pthread_sigstate (parent) != NULL)
     {
       __spin_lock (&__pthread_sigstate(parent)->lock);
@@ -295,6 +1525,29 @@ int pthread_create (pthread_t *ptp, const pthread_attr_t *attrp,
     }
   else
     sigemptyset (&__pthread_sigstate(pt)->blocked);
+}
+
+int pthread_create (pthread_t *ptp, const pthread_attr_t *attrp,
+  void* (*start_fct) (void *), void *argp)
+{
+  PTHREAD_FORK_FINISH ();
+  if (!attrp)
+    attrp = &__pthread_dfl_attr;
+
+  struct pthread *pt = thread_pool_get (attrp);
+  int pooled = pt != NULL;
+
+  if (pooled)
+    /* Pooled threads were created with the default detach state. */
+    pt->joinpt = (attrp->__flags & PTHREAD_CREATE_DETACHED) ? pt : NULL;
+  else if (!(pt = pt_allocate (attrp)))
+    return (EAGAIN);
+
+  pt_prepare (pt, PTHREAD_SELF, start_fct, argp);
+  /* Pooled threads were already prefaulted with the default amount. */
+  if (attrp->__prefault != 0 &&
+      (!pooled || attrp->__prefault > __pthread_dfl_attr.__prefault))
+    pt_prefault (pt, attrp->__prefault);
 
   /* At this point, all that's left is to initialize the machine state
    * for the new thread so that it may execute its entry point. We
@@ -304,15 +1557,9 @@ int pthread_create (pthread_t *ptp, const pthread_attr_t *attrp,
    * that simply means we lied for a bit, and it's no problem. */
 
   atomic_add (&__pthread_total, 1);
-  if (__pthread_set_machine_state (pt, thread_entry) != 0)
+  if (!pooled && __pthread_set_machine_state (pt, thread_entry) != 0)
     {
-      mach_port_t ktid = __pthread_kport (pt);
-      _hurd_sigstate_delete (ktid);
-      dealloc_tls (pt);
-      thread_terminate (ktid);
-
-      /* The stack is the last thing to clean up. */
-      free_stack (pt);
+      pt_destroy (pt);
       atomic_add (&__pthread_total, -1);
       return (EAGAIN);
     }
@@ -326,25 +1573,190 @@ int pthread_create (pthread_t *ptp, const pthread_attr_t *attrp,
   return (0);
 }
 
+int pthread_create_suspended_n_np (pthread_t *thrs, unsigned int n,
+  const pthread_attr_t *attrp, void* (*start_fct) (void *),
+  void *const *args)
+{
+  if (n == 0)
+    return (0);
+  else if (!attrp)
+    attrp = &__pthread_dfl_attr;
+
+  PTHREAD_FORK_FINISH ();
+
+  struct pthread **pts = (struct pthread **)thrs;
+  int ret;
+
+  if (attrp->__stack != NULL)
+    {
+      /* Threads can't share a user-supplied stack. */
+      if (n > 1)
+        return (EINVAL);
+
+      ret = (pts[0] = pt_allocate (attrp)) == NULL ? EAGAIN : 0;
+    }
+  else
+    ret = pt_allocate_n (attrp, pts, n);
+
+  if (ret != 0)
+    return (ret);
+
+  struct pthread *parent = PTHREAD_SELF;
+  for (unsigned int i = 0; i < n; ++i)
+    {
+      pt_prepare (pts[i], parent, start_fct, args ? args[i] : NULL);
+      if (attrp->__prefault != 0)
+        pt_prefault (pts[i], attrp->__prefault);
+
+      if (__pthread_set_machine_state (pts[i], thread_entry) != 0)
+        {
+          for (i = 0; i < n; ++i)
+            pt_destroy (pts[i]);
+
+          return (EAGAIN);
+        }
+    }
+
+  /* Only now may the threads be started. */
+  for (unsigned int i = 0; i < n; ++i)
+    atomic_or (&pts[i]->flags, PT_FLG_SUSPENDED);
+
+  return (0);
+}
+
+int pthread_start_n_np (const pthread_t *thrs, unsigned int n)
+{
+  struct pthread *const *pts = (struct pthread *const *)thrs;
+  unsigned int i;
+
+  for (i = 0; i < n; ++i)
+    if (pts[i] == NULL || !(atomic_load (&pts[i]->flags) & PT_FLG_SUSPENDED))
+      return (EINVAL);
+
+  /* Claim every thread before starting any, so that a thread
+   * that's listed twice, or started by someone else in the
+   * meantime, makes the whole call fail. */
+  for (i = 0; i < n; ++i)
+    if (!(atomic_and (&pts[i]->flags, ~PT_FLG_SUSPENDED) & PT_FLG_SUSPENDED))
+      {
+        while (i > 0)
+          atomic_or (&pts[--i]->flags, PT_FLG_SUSPENDED);
+
+        return (EINVAL);
+      }
+
+  /* The threads are accounted for before any of them run,
+   * for the same reasons as in 'pthread_create'. */
+  atomic_add (&__pthread_total, n);
+  if (n > 0)
+    atomic_store (&__pthread_mtflag, 1);
+
+  for (i = 0; i < n; ++i)
+    thread_resume (__pthread_kport (pts[i]));
+
+  return (0);
+}
+
+int pthread_create_n_np (pthread_t *thrs, unsigned int n,
+  const pthread_attr_t *attrp, void* (*start_fct) (void *),
+  void *const *args)
+{
+  int ret = pthread_create_suspended_n_np (thrs, n, attrp, start_fct, args);
+  return (ret != 0 ? ret : pthread_start_n_np (thrs, n));
+}
+
 void __pthread_deallocate (struct pthread *pt)
 {
-  if ((atomic_or (&pt->flags, PT_FLG_TERMINATED) &
-      PT_FLG_TERMINATED) == 0)
+  if (atomic_or (&pt->flags, PT_FLG_TERMINATED) & PT_FLG_TERMINATED)
+    return;
+
+  /* The thread left its ID and TCB behind,
+   * since it was still running on them. */
+  id_release (pt);
+  dealloc_tls (pt);
+  if (!(pt->flags & PT_FLG_USR_STACK) && !stack_cache_put (pt))
     free_stack (pt);
 }
 
-void __pthread_free_stacks (struct pthread *self)
+void __pthread_lock_running (void)
+{
+  for (int i = 0; i < PTHREAD_RUNNING_NLISTS; ++i)
+    lll_lock (&__running_threads[i].lock, 0);
+}
+
+void __pthread_unlock_running (void)
+{
+  for (int i = PTHREAD_RUNNING_NLISTS - 1; i >= 0; --i)
+    lll_unlock (&__running_threads[i].lock, 0);
+}
+
+void __pthread_lock_stacks (void)
+{
+  lll_lock (&stack_cache_lock, 0);
+  lll_lock (&thread_pool_lock, 0);
+  lll_lock (&dead_threads_lock, 0);
+
+  /* Holding the class lock keeps new classes from showing up. */
+  lll_lock (&arena_class_lock, 0);
+  for (struct arena_class *cp = arena_classes; cp != NULL; cp = cp->next)
+    lll_lock (&cp->lock, 0);
+}
+
+void __pthread_unlock_stacks (void)
 {
-  struct hurd_list *runp;
+  for (struct arena_class *cp = arena_classes; cp != NULL; cp = cp->next)
+    lll_unlock (&cp->lock, 0);
+
+  lll_unlock (&arena_class_lock, 0);
+  lll_unlock (&dead_threads_lock, 0);
+  lll_unlock (&thread_pool_lock, 0);
+  lll_unlock (&stack_cache_lock, 0);
+}
 
-  hurd_list_each (&__running_threads, runp)
+void __pthread_free_stacks (struct pthread *self)
+{
+  for (int i = 0; i < PTHREAD_RUNNING_NLISTS; ++i)
     {
-      struct pthread *pt = hurd_list_entry (runp, struct pthread, link);
-      if (pt == self)
-        continue;
+      struct hurd_list *listp = &__running_threads[i].list;
+      struct hurd_list *runp = listp->next;
 
-      dealloc_tls (pt);
-      free_stack (pt);
+      while (!hurd_list_end_p (listp, runp))
+        {
+          /* The link lives in the stack we're about to release. */
+          struct pthread *pt = hurd_list_entry (runp, struct pthread, link);
+          runp = runp->next;
+          if (pt == self)
+            continue;
+
+          dealloc_tls (pt);
+          free_stack_child (pt);
+        }
     }
+
+  stack_cache_flush ();
+  thread_pool_flush ();
+  dead_threads_flush ();
+  arena_flush_dead ();
+
+  /* Now that nothing refers to them, release the arenas
+   * with all the stacks inside. */
+  arena_flush (self);
+}
+
+void __pthread_drop_stacks (struct pthread *self)
+{
+  /* Cached stacks and pooled threads live in the arenas,
+   * so forgetting about them is enough. */
+  for (int i = 0; i < STACK_CACHE_NBUCKETS; ++i)
+    stack_cache[i].count = 0;
+
+  stack_cache_total = 0;
+  stack_cache_lock = 0;
+  thread_pool_cnt = 0;
+  thread_pool_lock = 0;
+  hurd_list_init (&dead_threads);
+  dead_threads_lock = 0;
+
+  arena_flush (self);
 }
 
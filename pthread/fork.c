@@ -19,7 +19,9 @@
 #include "pt-internal.h"
 #include "sysdep.h"
 #include "lowlevellock.h"
+#include "../sysdeps/atomic.h"
 #include <stdlib.h>
+#include <unistd.h>
 #include <errno.h>
 #include <string.h>
 
@@ -50,11 +52,26 @@ static unsigned int atfork_lock;
 #define atfork_sym(type, fct)   \
   defsymbol (_hurd_atfork_##type##_hook, fct)
 
+/* Test if the calling thread is forking through 'pthread_fork_spawn_np'.
+ * In that case, the child is expected to call 'exec' or '_exit' right
+ * away, so neither the handlers nor the registry locking are needed. */
+static inline int
+spawning_p (void)
+{
+  struct pthread *self = PTHREAD_SELF;
+  return (self != NULL && (self->flags & PT_FLG_SPAWN));
+}
+
 static void
 pt_atfork_prepare (void)
 {
   atfork_t *hp, *lastp;
 
+  /* A child that is forking again has to be in a sane state. */
+  PTHREAD_FORK_FINISH ();
+  if (spawning_p ())
+    return;
+
   lll_lock (&atfork_lock, 0);
   hp = atfork_handlers;
   lastp = atfork_last;
@@ -74,8 +91,10 @@ pt_atfork_prepare (void)
         }
     }
 
-  /* No more threads added or removed, until the child is created. */
-  lll_lock (&__running_threads_lock, 0);
+  /* No more threads added or removed, until the child is created.
+   * The child walks the cached stacks as well, so freeze them too. */
+  __pthread_lock_running ();
+  __pthread_lock_stacks ();
 }
 
 atfork_sym (prepare, pt_atfork_prepare);
@@ -85,6 +104,9 @@ pt_atfork_parent (void)
 {
   atfork_t *hp;
 
+  if (spawning_p ())
+    return;
+
   lll_lock (&atfork_lock, 0);
   hp = atfork_handlers;
   lll_unlock (&atfork_lock, 0);
@@ -94,38 +116,87 @@ pt_atfork_parent (void)
       hp->parent ();
 
   /* Thread creation and destruction allowed once again. */
-  lll_unlock (&__running_threads_lock, 0);
+  __pthread_unlock_stacks ();
+  __pthread_unlock_running ();
 }
 
 atfork_sym (parent, pt_atfork_parent);
 
+/* Reset the ID's, the running threads and the keys in a fork child,
+ * with SELF as the only thread. This needs no locks, and is done right
+ * away, so that the child keeps whatever it does with them. */
 static void
-pt_atfork_child (void)
+fork_reset_state (struct pthread *self)
 {
-  /* In the child, we have to re-initialize the whole lib. */
-  struct pthread *self = PTHREAD_SELF;
-
-  /* Reset the list lock. */
-  __running_threads_lock = 0;
-
-  /* The child starts with one pthread. */
-  __pthread_total = 1;
-
-  /* Set the ID to one, like all main threads. */
+  /* Set the ID to one, like all main threads, and reset
+   * the lists with this single thread. */
   self->id = __pthread_id_counter = 1;
+  memset (&__pthread_id_free, 0, sizeof (__pthread_id_free));
+  for (int i = 0; i < PTHREAD_RUNNING_NLISTS; ++i)
+    {
+      __running_threads[i].lock = 0;
+      hurd_list_init (&__running_threads[i].list);
+    }
+
+  hurd_list_add_tail (&PTHREAD_RUNNING_LIST (self)->list, &self->link);
 
   /* Clear global keys and misc variables. */
   memset (__pthread_keys, 0,
     PTHREAD_KEYS_MAX * sizeof (__pthread_keys[0]));
+  for (int i = 0; i < PTHREAD_KEY_NBLOCKS; ++i)
+    if (__pthread_key_blocks[i] != NULL)
+      memset (__pthread_key_blocks[i], 0,
+        (PTHREAD_KEYS_MAX << (i + 1)) * sizeof (__pthread_keys[0]));
+  __pthread_key_free.qv = 0;
+  memset (__pthread_fast_keys, 0,
+    PTHREAD_FAST_KEYS_NP * sizeof (__pthread_fast_keys[0]));
+  __pthread_key_hwm = 0;
   __pthread_concurrency = 0;
   __pthread_mtflag = 0;
+}
 
-  /* Deallocate every stack but this thread's. */
+/* Reset the library in a fork child, with SELF as the only thread. */
+static void
+fork_reset (struct pthread *self)
+{
+  /* Deallocate every stack but this thread's. This walks the
+   * running threads, so it must come before resetting them. */
   __pthread_free_stacks (self);
+  fork_reset_state (self);
+}
+
+void __pthread_fork_finish (void)
+{
+  /* The running threads list was reset at fork time, so the
+   * stacks it referred to can only be dropped wholesale. */
+  __pthread_fork_pending = 0;
+  __pthread_drop_stacks (PTHREAD_SELF);
+
+  /* The prepare handlers weren't run, so the child handlers aren't
+   * either. The lock may have been taken by some other thread. */
+  atfork_lock = 0;
+}
+
+static void
+pt_atfork_child (void)
+{
+  /* In the child, we have to re-initialize the whole lib. */
+  struct pthread *self = PTHREAD_SELF;
+
+  /* The child starts with one pthread. */
+  __pthread_total = 1;
+
+  if (self->flags & PT_FLG_SPAWN)
+    {
+      /* Leave the stacks for when the child does something else
+       * than calling 'exec' or '_exit'. */
+      self->flags &= ~PT_FLG_SPAWN;
+      fork_reset_state (self);
+      __pthread_fork_pending = 1;
+      return;
+    }
 
-  /* Reset the list with this single thread. */
-  hurd_list_init (&__running_threads);
-  hurd_list_add_tail (&__running_threads, &self->link);
+  fork_reset (self);
 
   /* Finally, execute the child handlers and clear them. */
   atfork_t *hp;
@@ -144,6 +215,18 @@ pt_atfork_child (void)
 
 atfork_sym (child, pt_atfork_child);
 
+pid_t pthread_fork_spawn_np (void)
+{
+  struct pthread *self = PTHREAD_SELF;
+  atomic_or (&self->flags, PT_FLG_SPAWN);
+
+  pid_t pid = fork ();
+  if (pid != 0)
+    atomic_and (&self->flags, ~PT_FLG_SPAWN);
+
+  return (pid);
+}
+
 /* The current DSO. */
 extern void *__dso_handle
   __attribute__ ((__weak__, __visibility__ ("hidden")));
@@ -26,14 +26,19 @@
 /* We have these global variables zero-initialized and then
  * manually construct them in the function below. This makes things
  * easier for the dynamic linker. */
-struct hurd_list __running_threads;
-unsigned int __running_threads_lock;
+struct pthread_running_list __running_threads[PTHREAD_RUNNING_NLISTS];
 unsigned int __pthread_id_counter;
+struct pthread_id_queue __pthread_id_free;
 unsigned int __pthread_total;
 struct pthread_key_data __pthread_keys[PTHREAD_KEYS_MAX];
+struct pthread_key_data *__pthread_key_blocks[PTHREAD_KEY_NBLOCKS];
+union hurd_xint __pthread_key_free;
+struct pthread_key_data __pthread_fast_keys[PTHREAD_FAST_KEYS_NP];
+unsigned int __pthread_key_hwm;
 pthread_attr_t __pthread_dfl_attr;
 int __pthread_concurrency;
 int __pthread_mtflag;
+int __pthread_fork_pending;
 
 /* Descriptor for the main thread. */
 static struct pthread __main_thread;
@@ -41,12 +46,18 @@ static struct pthread __main_thread;
 void  __attribute__ ((constructor)) __pthread_initialize (void)
 {
   struct pthread *pt = &__main_thread;
-  hurd_list_init (&__running_threads);
-  hurd_list_add_head (&__running_threads, &pt->link);
 
   /* The main thread has a fixed ID of one. */
   pt->id = __pthread_id_counter = 1;
 
+  /* Like every other thread, the main thread's first block
+   * of thread-specific data is the one in its descriptor. */
+  pt->specific[0] = pt->specific_blk1;
+
+  for (int i = 0; i < PTHREAD_RUNNING_NLISTS; ++i)
+    hurd_list_init (&__running_threads[i].list);
+  hurd_list_add_head (&PTHREAD_RUNNING_LIST (pt)->list, &pt->link);
+
   /* We have one running thread now. */
   __pthread_total = 1;
 
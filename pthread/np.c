@@ -20,6 +20,7 @@
 #include "lowlevellock.h"
 #include "sysdep.h"
 #include <hurd/signal.h>
+#include <mach_init.h>
 
 mach_port_t pthread_kport_np (pthread_t th)
 {
@@ -35,13 +36,14 @@ struct hurd_sigstate* pthread_sigstate_np (pthread_t th)
 
 /* 'pthread_foreach_np' is not itself a cancellation point, but because
  * it executes a user-provided callback, it may turn into one. As such,
- * we need a cleanup handler to release the running threads lock in case
+ * we need a cleanup handler to release the running threads locks in case
  * it's cancelled. */
 
 static void
 cleanup (void *argp)
 {
-  lll_unlock (argp, 0);
+  (void)argp;
+  __pthread_unlock_running ();
 }
 
 int pthread_foreach_np (int (*fct) (pthread_t, void *), void *argp)
@@ -49,23 +51,40 @@ int pthread_foreach_np (int (*fct) (pthread_t, void *), void *argp)
   struct hurd_list *runp;
   int ret = 0;
 
-  lll_lock (&__running_threads_lock, 0);
-  pthread_cleanup_push (cleanup, &__running_threads_lock);
+  PTHREAD_FORK_FINISH ();
+  __pthread_lock_running ();
+  pthread_cleanup_push (cleanup, NULL);
   int prev = __pthread_cancelpoint_begin ();
 
-  hurd_list_each (&__running_threads, runp)
-    {
-      struct pthread *pt = hurd_list_entry (runp, struct pthread, link);
-      ret = fct ((pthread_t)pt, argp);
-      if (ret < 0)
-        break;
-    }
+  for (int i = 0; i < PTHREAD_RUNNING_NLISTS && ret >= 0; ++i)
+    hurd_list_each (&__running_threads[i].list, runp)
+      {
+        struct pthread *pt = hurd_list_entry (runp, struct pthread, link);
+        ret = fct ((pthread_t)pt, argp);
+        if (ret < 0)
+          break;
+      }
 
   __pthread_cancelpoint_end (prev);
   pthread_cleanup_pop (1);
   return (ret);
 }
 
+int pthread_getstackusage_np (pthread_t th, size_t *outp)
+{
+  struct pthread *pt = (struct pthread *)th;
+  if (INVALID_P (pt))
+    return (ESRCH);
+  else if (pt->flags & PT_FLG_MAIN_THREAD)
+    /* We don't really know where the main thread's stack ends. */
+    return (ENOTSUP);
+
+  /* Only touches the pages that have been used, and a few more. */
+  char *low = (char *)__pthread_stack_scan (pt->stack, pt, pt, 0);
+  *outp = (char *)pt->stack + pt->stacksize - low;
+  return (0);
+}
+
 int pthread_gettid_np (pthread_t th, unsigned int *outp)
 {
   struct pthread *pt = (struct pthread *)th;
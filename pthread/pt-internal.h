@@ -49,6 +49,8 @@ struct pthread_key_data
     {
       void *data;
       void (*destr) (void *);
+      /* Link in the free-key stack, for unused keys. */
+      unsigned int next;
     };
 };
 
@@ -60,9 +62,14 @@ struct pthread_key_data
  * infinite loops, the implementation only retries this many times. */
 #define PTHREAD_DESTRUCTION_ITERATIONS   4
 
-/* A rather arbitrary limit. */
+/* Number of keys that are described by the static array __pthread_keys.
+ * Beyond that, keys live in dynamically allocated blocks, each twice
+ * as large as the previous one. Must be a power of 2. */
 #define PTHREAD_KEYS_MAX   512
 
+/* Number of dynamically allocated key blocks. */
+#define PTHREAD_KEY_NBLOCKS   21
+
 /* When dynamically allocating thread-specific data via pthread keys,
  * we do so in chunks of the following constant. The first of the 
  * blocks is actually statically allocated within the pthread descriptor,
@@ -70,44 +77,76 @@ struct pthread_key_data
 #define PTHREAD_KEY_L2_SIZE   16
 
 /* Given the above 2 constants, the pointer array used for TSD should
- * have no more than the following entries in order to address the
- * maximum number of keys we allow. */
+ * have the following entries in order to address the keys in the static
+ * array. Higher keys are addressed by a secondary array that grows on
+ * demand, so that the fast path only involves the first one. */
 #define PTHREAD_KEY_L1_SIZE   \
   ((PTHREAD_KEYS_MAX + PTHREAD_KEY_L2_SIZE - 1) / PTHREAD_KEY_L2_SIZE)
 
+/* Number of words in the bitmap of keys set by a thread. */
+#define PTHREAD_KEY_MAP_SIZE   (PTHREAD_KEYS_MAX / 32)
+
+struct stack_arena;
+
 /* Thread descriptor type. */
 struct pthread
 {
+  /* The first cache line holds the fields read by the thread on its
+   * own fast paths: mutex ownership, cancellation checks, cleanup
+   * handlers and the state of its thread-specific data. Other threads
+   * only write to it at most once in a thread's lifetime (cancellation,
+   * death). The thread-specific values themselves don't fit in it. */
+
   /* Thread control block, keeps a list of thread-local data,
    * and maintains a pointer to this very descriptor, to make
    * 'pthread_self' a very fast operation. */
   void *tcb;
 
-  /* Link in the running threads list. */
-  struct hurd_list link;
-
-  /* Chain of cleanup callbacks and their arguments. */
-  struct __pthread_cleanup_buf *cleanup;
-
   /* Unique id used to identify mutex/rwlock ownership. */
   unsigned int id;
 
   /* Descriptor flags. Includes cancellation state. */
   int flags;
 
-  /* Thread-specific data blocks. */
-  struct pthread_key_data specific_blk1[PTHREAD_KEY_L2_SIZE];
-  struct pthread_key_data *specific[PTHREAD_KEY_L1_SIZE];
+  /* Chain of cleanup callbacks and their arguments. */
+  struct __pthread_cleanup_buf *cleanup;
 
   /* During thread-exit time, this flag is checked in order
    * to know if we have to deallocate TSD. Since most threads don't
    * use TSD at all, this can be considered an optimization. */
   int specific_used;
 
+  /* Secondary array of thread-specific data blocks, for keys
+   * past the static ones. */
+  struct pthread_key_data **specific_ext;
+  unsigned int specific_ext_size;
+
+  /* Fields that other threads write to on their own account share
+   * the second line, so that they don't bounce the one above. */
+
+  /* Link in the running threads list. Modified whenever a
+   * neighbouring thread starts or exits. */
+  struct hurd_list link __attribute__ ((__aligned__ (64)));
+
   /* Joiner pthread. For detached pthreads, this points to itself,
    * since it's otherwise impossible to do so. */
   struct pthread *joinpt;
 
+  /* Thread-specific data blocks. The first one is always the static
+   * block below, so the values of the first PTHREAD_KEY_L2_SIZE keys
+   * are read straight from it, without going through the array. */
+  struct pthread_key_data *specific[PTHREAD_KEY_L1_SIZE]
+    __attribute__ ((__aligned__ (64)));
+  struct pthread_key_data specific_blk1[PTHREAD_KEY_L2_SIZE];
+
+  /* The rest is only used when starting or exiting. */
+
+  /* Bitmaps of the keys that have a value set, so that thread exit
+   * only has to visit those. The second one covers the keys in the
+   * secondary array, and grows along with it. */
+  unsigned int specific_map[PTHREAD_KEY_MAP_SIZE];
+  unsigned int *specific_ext_map;
+
   /* Thread routine, its argument and return value. */
   void* (*start_fct) (void *);
   void *argp;
@@ -118,13 +157,36 @@ struct pthread
   size_t stacksize;
   size_t guardsize;
 
-  /* Resolver state. */
-  struct __res_state res_state;
+  /* Lowest address of the stack that any of its owners is
+   * known to have used. */
+  void *stack_mark;
+
+  /* Arena the stack was carved from, if any. */
+  struct stack_arena *arena;
+
+  /* ID of the thread once it's dead, until it's released. */
+  unsigned int dead_id;
+
+  /* Value of the stack cache clock when the stack was cached. */
+  unsigned int cache_tick;
+
+  /* Resolver state. It lives above the descriptor, in memory that's
+   * only touched once the thread uses the resolver. */
+  struct __res_state *resp;
 
   /* Special exception used for forced stack unwinding. */
   struct __pthread_unwind_exc exc;
 };
 
+/* Check the layout described above. */
+_Static_assert (offsetof (struct pthread, specific_ext_size) +
+  sizeof (unsigned int) <= 64, "hot fields must fit in the first line");
+_Static_assert (offsetof (struct pthread, link) == 64 &&
+  offsetof (struct pthread, joinpt) + sizeof (void *) <= 128,
+  "the link and joiner must be on the second line");
+_Static_assert (offsetof (struct pthread, specific) == 128,
+  "thread-specific data must start on the third line");
+
 /* The kernel port is already stored in the signal state,
  * so fetching it is simple enough. */
 #define __pthread_kport(pt)      __pthread_sigstate(pt)->thread
@@ -148,6 +210,8 @@ struct pthread
 #define PT_FLG_CANCEL_DISABLE   (1U << 6)
 #define PT_FLG_CANCEL_TRANS     (1U << 7)
 #define PT_FLG_MAIN_THREAD      (1U << 8)
+#define PT_FLG_SPAWN            (1U << 9)
+#define PT_FLG_SUSPENDED        (1U << 10)
 
 /* Test if FLG denotes any cancellation. */
 #define CANCELLED_ENABLED_P(flg)   \
@@ -162,6 +226,21 @@ struct pthread
              PT_FLG_TERMINATED)) ==   \
      (PT_FLG_CANCEL_ASYNC | PT_FLG_CANCELLED))
 
+/* The running threads are kept in several lists, each with its own
+ * lock, so that threads starting and exiting at the same time rarely
+ * contend. A thread's list is selected by its ID. Must be a power of 2. */
+#define PTHREAD_RUNNING_NLISTS   16
+
+struct pthread_running_list
+{
+  unsigned int lock;
+  struct hurd_list list;
+} __attribute__ ((__aligned__ (64)));
+
+/* Get the running list for thread PT. */
+#define PTHREAD_RUNNING_LIST(pt)   \
+  (&__running_threads[(pt)->id & (PTHREAD_RUNNING_NLISTS - 1)])
+
 /* A pthread is detached if the joiner pthread is itself. */
 #define DETACHED_P(pt)   ((pt)->joinpt == (pt))
 
@@ -169,21 +248,46 @@ struct pthread
  * death by clearing the ID field. */
 #define INVALID_P(pt)    (!(pt) || (pt)->id == 0)
 
+/* Queue of the ID's released by dead threads. */
+struct pthread_id_queue
+{
+  unsigned int lock;
+  unsigned int head;
+  unsigned int tail;
+  unsigned int count;
+};
+
 /* Global variables. */
-extern struct hurd_list __running_threads;
-extern unsigned int __running_threads_lock;
+extern struct pthread_running_list __running_threads[];
 extern unsigned int __pthread_id_counter;
+extern struct pthread_id_queue __pthread_id_free;
 extern unsigned int __pthread_total;
 extern pthread_attr_t __pthread_dfl_attr;
 extern struct pthread_key_data __pthread_keys[];
+extern struct pthread_key_data *__pthread_key_blocks[];
+extern union hurd_xint __pthread_key_free;
+extern struct pthread_key_data __pthread_fast_keys[];
+extern unsigned int __pthread_key_hwm;
 extern int __pthread_concurrency;
 extern int __pthread_mtflag;
+extern int __pthread_fork_pending;
 
 /* Internal functions. */
 
 /* Deallocate all thread-specific data held by the thread descriptor. */
 extern void __pthread_dealloc_tsd (struct pthread *);
 
+/* Save the state of the fast keys for the calling thread's destructors.
+ * Must be called before the thread leaves the running list. */
+extern void __pthread_save_fast_keys (void);
+
+/* Find the lowest word in use in the stack between LO and HI, which are
+ * handed out zero-filled and used from the top down. The stack is scanned
+ * from HI down, a page at a time, until a run of clean pages below FLOOR.
+ * If CLEAR is true, the words in use are zeroed along the way. Returns
+ * HI if every word is clean. */
+extern void* __pthread_stack_scan (void *, void *, void *, int);
+
 /* Deallocate a thread descriptor's stack, if it hasn't already. */
 extern void __pthread_deallocate (struct pthread *);
 
@@ -191,9 +295,31 @@ extern void __pthread_deallocate (struct pthread *);
  * to terminate it. */
 extern void __pthread_cleanup (struct pthread *);
 
+/* Acquire and release the locks of every running threads list,
+ * in order to get a consistent view of all of them. */
+extern void __pthread_lock_running (void);
+extern void __pthread_unlock_running (void);
+
+/* Acquire and release the locks that protect the cached stacks,
+ * so that a fork child finds them in a consistent state. */
+extern void __pthread_lock_stacks (void);
+extern void __pthread_unlock_stacks (void);
+
 /* Deallocate every thread stack, except for the calling thread's. */
 extern void __pthread_free_stacks (struct pthread *);
 
+/* Like the above, but without looking at the running threads, which
+ * may be inconsistent. Some memory may be leaked as a result. */
+extern void __pthread_drop_stacks (struct pthread *);
+
+/* Finish resetting the library in a fork child that was created
+ * by 'pthread_fork_spawn_np', once it turns out it keeps running. */
+extern void __pthread_fork_finish (void);
+
+#define PTHREAD_FORK_FINISH()   \
+  (__glibc_unlikely (__pthread_fork_pending) ?   \
+    __pthread_fork_finish () : (void)0)
+
 /* Switch cancellation type from deferred to asynchronous; start
  * a cancellation point. */
 extern int __pthread_cancelpoint_begin (void);
@@ -50,6 +50,7 @@ typedef struct
       int __policy;
       int __data;
     } __sched;
+  unsigned long __prefault;
 } pthread_attr_t;
 
 /* Various flags that may be set in pthread attributes. */
@@ -114,6 +115,15 @@ extern int pthread_attr_setguardsize (pthread_attr_t *__attrp,
 extern int pthread_attr_getguardsize (const pthread_attr_t *__attrp,
   size_t *__outp) __THROW __nonnull ((1, 2));
 
+/* Set the number of bytes at the top of the stack that are faulted
+ * in before a thread created with ATTRP starts running. */
+extern int pthread_attr_setprefault_np (pthread_attr_t *__attrp,
+  size_t __size) __THROW __nonnull ((1));
+
+/* Get the number of bytes to prefault for ATTRP in *OUTP. */
+extern int pthread_attr_getprefault_np (const pthread_attr_t *__attrp,
+  size_t *__outp) __THROW __nonnull ((1, 2));
+
 /* Set the thread scope in ATTRP to SCOPE. */
 extern int pthread_attr_setscope (pthread_attr_t *__attrp,
   int __scope) __THROW __nonnull ((1));
@@ -150,6 +160,24 @@ extern int pthread_attr_getschedpolicy (const pthread_attr_t *__attrp,
 extern int pthread_getattr_np (pthread_t __thr,
   pthread_attr_t *__attrp) __THROW __nonnull ((2));
 
+/* Set the attributes used by threads created without any to ATTRP,
+ * which may not specify a stack address. */
+extern int pthread_setattr_default_np (const pthread_attr_t *__attrp)
+  __THROW __nonnull ((1));
+
+/* Get the attributes used by threads created without any in *ATTRP. */
+extern int pthread_getattr_default_np (pthread_attr_t *__attrp)
+  __THROW __nonnull ((1));
+
+/* Store in *OUTP the maximum amount of stack THR has used so far,
+ * measured from the top of its stack. This is meant for tuning stack
+ * sizes, and its cost grows with the amount of stack used. The result
+ * may be too large for stacks supplied by the user, unless they were
+ * zero-filled, and too small if the thread left several pages in a
+ * row untouched, or zeroed, between the top and its deepest frame. */
+extern int pthread_getstackusage_np (pthread_t __thr, size_t *__outp)
+  __THROW __nonnull ((2));
+
 /* Destroy thread attributes ATTRP. */
 extern int pthread_attr_destroy (pthread_attr_t *__attrp)
   __THROW __nonnull ((1));
@@ -162,6 +190,27 @@ extern int pthread_create (pthread_t *__thrp,
   void* (*__start_fct) (void *), void *__argp)
     __THROWNL __nonnull ((1, 3));
 
+/* Create N threads using the attributes in ATTRP if non-null, storing
+ * their descriptors in THRS. The I-th thread executes START_FCT with
+ * argument ARGS[I], or a null pointer if ARGS is null. Either all
+ * threads are created, or none are. */
+extern int pthread_create_n_np (pthread_t *__thrs, unsigned int __n,
+  const pthread_attr_t *__attrp, void* (*__start_fct) (void *),
+  void *const *__args) __THROWNL __nonnull ((1, 4));
+
+/* Like 'pthread_create_n_np', but leave the threads suspended until
+ * they are started by 'pthread_start_n_np'. */
+extern int pthread_create_suspended_n_np (pthread_t *__thrs,
+  unsigned int __n, const pthread_attr_t *__attrp,
+  void* (*__start_fct) (void *), void *const *__args)
+    __THROWNL __nonnull ((1, 4));
+
+/* Start the N threads in THRS, created by 'pthread_create_suspended_n_np'.
+ * Fails with EINVAL, without starting any, if any of them wasn't created
+ * that way, or was already started. */
+extern int pthread_start_n_np (const pthread_t *__thrs, unsigned int __n)
+  __THROW __nonnull ((1));
+
 /* Return the descriptor for the calling thread. */
 extern pthread_t pthread_self (void) __THROW __attribute__ ((const));
 
@@ -210,6 +259,13 @@ extern int pthread_setschedprio (pthread_t __th, int __prio) __THROW;
 extern int pthread_atfork (void (*__prepare) (void),
   void (*__parent) (void), void (*__child) (void));
 
+/* Like 'fork', but meant for a child that calls 'exec' or '_exit' right
+ * away, as with 'vfork'. The callbacks registered by 'pthread_atfork'
+ * are not called, thread creation and exit are not blocked in the
+ * parent, and releasing the other threads' stacks in the child is
+ * deferred until it creates threads again. */
+extern pid_t pthread_fork_spawn_np (void) __THROWNL;
+
 /* Process shared flags. */
 enum
 {
@@ -530,6 +586,7 @@ extern int pthread_rwlock_destroy (pthread_rwlock_t *__rwp)
 typedef struct
 {
   int __flags;
+  int __spins;
 } pthread_barrierattr_t;
 
 typedef struct
@@ -538,11 +595,55 @@ typedef struct
   unsigned int __nrefs;
   unsigned int __total;
   int __flags;
+  unsigned int __nsleep;
+  int __spins;
+  void *__nodes;
+  union hurd_xint __acc;
+  long int __result;
 } pthread_barrier_t;
 
+/* Token handed out by split-phase barrier arrivals. */
+typedef struct
+{
+  unsigned int __seq;
+  unsigned int __leaf;
+  int __depth;
+  int __flags;
+} pthread_barrier_token_t;
+
 /* Special value returned to the last barrier waiter. */
 #define PTHREAD_BARRIER_SERIAL_THREAD   1
 
+/* Barrier types. */
+enum
+{
+  PTHREAD_BARRIER_CENTRAL_NP,
+#define PTHREAD_BARRIER_CENTRAL_NP   PTHREAD_BARRIER_CENTRAL_NP
+  PTHREAD_BARRIER_TREE_NP
+#define PTHREAD_BARRIER_TREE_NP      PTHREAD_BARRIER_TREE_NP
+};
+
+/* Barrier reduction operations. */
+enum
+{
+  PTHREAD_BARRIER_REDUCE_SUM_NP,
+#define PTHREAD_BARRIER_REDUCE_SUM_NP   PTHREAD_BARRIER_REDUCE_SUM_NP
+  PTHREAD_BARRIER_REDUCE_MIN_NP,
+#define PTHREAD_BARRIER_REDUCE_MIN_NP   PTHREAD_BARRIER_REDUCE_MIN_NP
+  PTHREAD_BARRIER_REDUCE_MAX_NP,
+#define PTHREAD_BARRIER_REDUCE_MAX_NP   PTHREAD_BARRIER_REDUCE_MAX_NP
+  PTHREAD_BARRIER_REDUCE_AND_NP,
+#define PTHREAD_BARRIER_REDUCE_AND_NP   PTHREAD_BARRIER_REDUCE_AND_NP
+  PTHREAD_BARRIER_REDUCE_OR_NP,
+#define PTHREAD_BARRIER_REDUCE_OR_NP    PTHREAD_BARRIER_REDUCE_OR_NP
+  PTHREAD_BARRIER_REDUCE_XOR_NP
+#define PTHREAD_BARRIER_REDUCE_XOR_NP   PTHREAD_BARRIER_REDUCE_XOR_NP
+};
+
+/* Special spin count that lets the implementation learn how long
+ * waiters should spin before going to sleep. This is the default. */
+#define PTHREAD_BARRIER_SPIN_ADAPTIVE_NP   (-1)
+
 /* Initialize barrier attributes ATTRP. */
 extern int pthread_barrierattr_init (pthread_barrierattr_t *__attrp)
   __THROW __nonnull ((1));
@@ -555,6 +656,25 @@ extern int pthread_barrierattr_setpshared (pthread_barrierattr_t *__attrp,
 extern int pthread_barrierattr_getpshared (const pthread_barrierattr_t *__atp,
   int *__outp) __THROW __nonnull ((1, 2));
 
+/* Set the barrier type in ATTRP to TYPE. Tree barriers spread arrivals
+ * and wakeups over a combining tree, which scales better with large
+ * thread counts, but they may not be shared between processes. */
+extern int pthread_barrierattr_settype_np (pthread_barrierattr_t *__attrp,
+  int __type) __THROW __nonnull ((1));
+
+/* Get the barrier type for ATTRP in *OUTP. */
+extern int pthread_barrierattr_gettype_np (const pthread_barrierattr_t *__atp,
+  int *__outp) __THROW __nonnull ((1, 2));
+
+/* Set the number of iterations that waiters spin for before going to
+ * sleep in ATTRP to SPINS. Zero disables spinning altogether. */
+extern int pthread_barrierattr_setspin_np (pthread_barrierattr_t *__attrp,
+  int __spins) __THROW __nonnull ((1));
+
+/* Get the spin count for ATTRP in *OUTP. */
+extern int pthread_barrierattr_getspin_np (const pthread_barrierattr_t *__atp,
+  int *__outp) __THROW __nonnull ((1, 2));
+
 /* Destroy barrier attributes ATTRP. */
 extern int pthread_barrierattr_destroy (pthread_barrierattr_t *__attrp)
   __THROW __nonnull ((1));
@@ -569,6 +689,24 @@ extern int pthread_barrier_init (pthread_barrier_t *__barp,
 extern int pthread_barrier_wait (pthread_barrier_t *__barp)
   __THROWNL __nonnull ((1));
 
+/* Wait on barrier BARP, contributing *VALP to a reduction with
+ * operation OP. On return, *VALP holds the combination of the values
+ * contributed by every participant. */
+extern int pthread_barrier_wait_reduce_np (pthread_barrier_t *__barp,
+  long int *__valp, int __op) __THROWNL __nonnull ((1, 2));
+
+/* Register the calling thread's arrival at barrier BARP without
+ * waiting for the rest of the participants, and store in *TOKP what
+ * is needed to complete the wait later on. */
+extern int pthread_barrier_arrive_np (pthread_barrier_t *__barp,
+  pthread_barrier_token_t *__tokp) __THROW __nonnull ((1, 2));
+
+/* Complete the wait on barrier BARP started by the arrival that
+ * returned *TOKP. Every arrival must be matched by a call to this
+ * function before the thread arrives at BARP again. */
+extern int pthread_barrier_wait_token_np (pthread_barrier_t *__barp,
+  const pthread_barrier_token_t *__tokp) __THROWNL __nonnull ((1, 2));
+
 /* Destroy barrier BARP. */
 extern int pthread_barrier_destroy (pthread_barrier_t *__barp)
   __THROW __nonnull ((1));
@@ -692,6 +830,50 @@ extern void* pthread_getspecific (pthread_key_t __key);
 /* Delete the key KEY. */
 extern int pthread_key_delete (pthread_key_t __key);
 
+/* Create N keys at once and store them in KEYS, using DESTR as the
+ * destructor for all of them. Either every key is created, or none. */
+extern int pthread_key_create_n_np (pthread_key_t *__keys, unsigned int __n,
+  void (*__destr) (void *)) __THROW __nonnull ((1));
+
+/* Fast keys. Their values live in static TLS, so that accessing them
+ * only takes a single load relative to the thread pointer. There is
+ * only a small number of them, and they have their own key space. */
+#define PTHREAD_FAST_KEYS_NP   16
+
+extern __thread void *__pthread_fast_slots[PTHREAD_FAST_KEYS_NP]
+  __attribute__ ((tls_model ("initial-exec")));
+
+/* Create a fast key, storing it in *KEYP. */
+extern int pthread_fast_key_create_np (pthread_key_t *__keyp,
+  void (*__destr) (void *)) __THROW __nonnull ((1));
+
+/* Delete the fast key KEY. Its value is cleared for every thread. */
+extern int pthread_fast_key_delete_np (pthread_key_t __key) __THROW;
+
+/* Get and set the value of the fast key KEY for the calling thread.
+ * KEY must have been returned by 'pthread_fast_key_create_np'. */
+extern void* pthread_fast_getspecific_np (pthread_key_t __key) __THROW;
+
+extern int pthread_fast_setspecific_np (pthread_key_t __key,
+  const void *__valp) __THROW;
+
+#ifdef __USE_EXTERN_INLINES
+
+__extern_inline void*
+__NTH (pthread_fast_getspecific_np (pthread_key_t __key))
+{
+  return (__pthread_fast_slots[__key]);
+}
+
+__extern_inline int
+__NTH (pthread_fast_setspecific_np (pthread_key_t __key, const void *__valp))
+{
+  __pthread_fast_slots[__key] = (void *)__valp;
+  return (0);
+}
+
+#endif
+
 /* Non-portable definitions. */
 
 /* Yield the CPU to another thread or process. */
@@ -29,6 +29,9 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <mach.h>
 
 int sem_init (sem_t *semp, int pshared, unsigned int val)
@@ -42,9 +45,21 @@ int sem_init (sem_t *semp, int pshared, unsigned int val)
   return (0);
 }
 
-int sem_post (sem_t *semp)
+/* The flags word of a semaphore holds the gsync flags in its low bits,
+ * and the spin estimate (see below) in the high ones, so that the type
+ * keeps its size. The gsync flags never change after initialization,
+ * so updating the estimate with a plain store doesn't lose them. */
+#define SEM_GSYNC_MASK    0xffff
+#define SEM_SPINS_SHIFT   16
+
+#define sem_gsync_flags(semp)   \
+  (atomic_load (&(semp)->__flags) & SEM_GSYNC_MASK)
+
+static int
+__sem_post (sem_t *semp, unsigned int cnt)
 {
   union hurd_xint tmp;
+  unsigned int nwake;
 
   /* Bump the semaphore's counter value and also fetch the number of
    * waiters. Before incrementing, test that the counter does not
@@ -53,23 +68,39 @@ int sem_post (sem_t *semp)
   while (1)
     {
       tmp.qv = atomic_loadx (&semp->__val_nw.qv);
-      if (tmp.lo == SEM_VALUE_MAX)
+      if (cnt > SEM_VALUE_MAX - tmp.lo)
         {
           errno = EOVERFLOW;
           return (-1);
         }
       else if (atomic_casx_bool (&semp->__val_nw.qv,
-          tmp.lo, tmp.hi, tmp.lo + 1, tmp.hi))
+          tmp.lo, tmp.hi, tmp.lo + cnt, tmp.hi))
         break;
     }
 
-  /* If there were waiters, wake one of them. */
-  if (tmp.hi > 0)
-    lll_wake (&semp->__val_nw.lo, semp->__flags);
+  /* If there were waiters, wake as many of them as units were posted,
+   * one request each. When that's all of them, a single broadcast does
+   * the job. */
+  nwake = cnt < tmp.hi ? cnt : tmp.hi;
+  if (nwake > 1 && nwake == tmp.hi)
+    lll_wake (&semp->__val_nw.lo, sem_gsync_flags (semp) | GSYNC_BROADCAST);
+  else
+    while (nwake-- > 0)
+      lll_wake (&semp->__val_nw.lo, sem_gsync_flags (semp));
 
   return (0);
 }
 
+int sem_post (sem_t *semp)
+{
+  return (__sem_post (semp, 1));
+}
+
+int sem_post_multiple_np (sem_t *semp, unsigned int cnt)
+{
+  return (cnt == 0 ? 0 : __sem_post (semp, cnt));
+}
+
 static inline int
 __sem_trywait (sem_t *semp)
 {
@@ -83,6 +114,46 @@ __sem_trywait (sem_t *semp)
     }
 }
 
+/* Upper bound for the number of times a waiter polls the counter
+ * before registering itself and going to sleep. */
+#define SEM_SPIN_MAX   200
+
+/* Poll the counter for a while before blocking. The number of
+ * iterations adapts to how long previous waiters had to spin before
+ * succeeding, and shrinks whenever spinning fails, so that semaphores
+ * that are rarely posted quickly stop wasting cycles. Spinning waiters
+ * don't count as such, so posters don't have to wake them. */
+static int
+__sem_spinwait (sem_t *semp)
+{
+  int flags = atomic_load (&semp->__flags);
+  int spins = (unsigned int)flags >> SEM_SPINS_SHIFT;
+  int max = spins * 2 + 10;
+  int cnt, nspins, ret = -1;
+
+  if (max > SEM_SPIN_MAX)
+    max = SEM_SPIN_MAX;
+
+  for (cnt = 0; cnt < max; ++cnt)
+    {
+      if (__sem_trywait (semp) == 0)
+        {
+          ret = 0;
+          break;
+        }
+
+      atomic_spin_nop ();
+    }
+
+  /* The update is racy, but it's only a hint. */
+  nspins = ret == 0 ? spins + (cnt - spins) / 8 : spins - (spins + 7) / 8;
+  if (nspins != spins)
+    atomic_store (&semp->__flags,
+      (flags & SEM_GSYNC_MASK) | (nspins << SEM_SPINS_SHIFT));
+
+  return (ret);
+}
+
 static void
 cleanup (void *argp)
 {
@@ -94,7 +165,7 @@ int sem_wait (sem_t *semp)
   int ret = 0;
 
   /* See if we can decrement the counter's value without blocking. */
-  if (__sem_trywait (semp) == 0)
+  if (__sem_trywait (semp) == 0 || __sem_spinwait (semp) == 0)
     return (0);
 
   /* Slow path: Add ourselves as a waiter, set up things for
@@ -119,7 +190,7 @@ int sem_wait (sem_t *semp)
       /* Enable async cancellation, block on the counter's
        * address and restore the previous cancellation type. */
       int prev = __pthread_cancelpoint_begin ();
-      int res = lll_wait (&semp->__val_nw.lo, 0, semp->__flags);
+      int res = lll_wait (&semp->__val_nw.lo, 0, sem_gsync_flags (semp));
       __pthread_cancelpoint_end (prev);
 
       if (res == KERN_INTERRUPTED)
@@ -149,7 +220,7 @@ int sem_timedwait (sem_t *semp, const struct timespec *tsp)
 {
   int ret = 0;
 
-  if (__sem_trywait (semp) == 0)
+  if (__sem_trywait (semp) == 0 || __sem_spinwait (semp) == 0)
     return (0);
 
   atomic_addx_hi (&semp->__val_nw.qv, 1);
@@ -178,7 +249,8 @@ int sem_timedwait (sem_t *semp, const struct timespec *tsp)
         }
 
       int prev = __pthread_cancelpoint_begin ();
-      int res = lll_abstimed_wait (&semp->__val_nw.lo, 0, tsp, semp->__flags);
+      int res = lll_abstimed_wait (&semp->__val_nw.lo, 0, tsp,
+        sem_gsync_flags (semp));
       __pthread_cancelpoint_end (prev);
 
       if (res == KERN_INTERRUPTED || res == KERN_TIMEDOUT)
@@ -213,11 +285,103 @@ int sem_destroy (sem_t *semp)
 
 /* Shared semaphores. */
 
+/* Named semaphores with short names, created with mode SEM_SLAB_MODE,
+ * are packed into a slab that lives in the semaphore directory. Every
+ * user has a slab of their own, only accessible to them, which is why
+ * only semaphores that nobody else may open can go there. The rest get
+ * a backing file each, so that their mode applies to them alone. Once a
+ * task has mapped a semaphore in the slab, opening and closing it again
+ * is done entirely in user space.
+ *
+ * Names are found through an open-addressing index at the beginning of
+ * the slab, which can be searched without locking it: an odd sequence
+ * number tells readers that entries are being moved around, and a change
+ * in it that they have to look again. Adding and removing names is done
+ * while holding a lock on the slab file, which, being a file lock, is
+ * released by the file server if its holder dies. Removed names don't
+ * leave anything behind in the index, so that lookups stay short.
+ *
+ * Names for semaphores with a backing file don't involve the lock. So
+ * that a name doesn't end up in both places, whoever creates a semaphore
+ * checks the other place after making theirs visible, and a task that
+ * finds a name in the slab after creating the file backs off.
+ *
+ * Tasks don't record which slots they have open, since that would be
+ * lost whenever one of them died. Instead, the slot of an unlinked
+ * semaphore is retired for good, and once the slots run out, new
+ * semaphores get a backing file like the others. */
+
+#define SEM_SLAB_SIZE     (64 * 1024)
+#define SEM_SLOT_SIZE     64
+#define SEM_SLAB_MAGIC    0x686c7033   /* 'hlp3' */
+#define SEM_SLAB_MODE     0600
+#define SEM_SLAB_NINDEX   2048
+
+#define SEM_SLOT_NAMELEN   \
+  (SEM_SLOT_SIZE - 2 * sizeof (unsigned int) - sizeof (sem_t))
+
+/* Slot states. */
+#define SEM_SLOT_USED   1U
+#define SEM_SLOT_DEAD   2U
+
+struct sem_slot
+{
+  unsigned int state;
+  unsigned int hash;
+  char name[SEM_SLOT_NAMELEN];
+  sem_t sem;
+};
+
+/* Index entry. SLOT is one plus the number of the slot holding
+ * the semaphore, or zero if the entry is empty. */
+struct sem_index
+{
+  unsigned int slot;
+  unsigned int hash;
+};
+
+/* The first slot is used as the slab header. */
+struct sem_slab
+{
+  union
+    {
+      struct
+        {
+          unsigned int magic;
+          unsigned int nslots;
+          /* Number of slots handed out so far. */
+          unsigned int nused;
+          /* Odd while entries are being moved in the index. */
+          unsigned int seq;
+        };
+
+      struct sem_slot __pad;
+    };
+
+  struct sem_index index[SEM_SLAB_NINDEX];
+  struct sem_slot slots[];
+};
+
+#define SEM_SLAB_NSLOTS   \
+  ((SEM_SLAB_SIZE - sizeof (struct sem_slab)) / SEM_SLOT_SIZE)
+
+_Static_assert (sizeof (struct sem_slot) == SEM_SLOT_SIZE,
+  "semaphore slots must be exactly SEM_SLOT_SIZE bytes");
+_Static_assert (sizeof (struct sem_slab) % SEM_SLOT_SIZE == 0 &&
+  SEM_SLAB_NSLOTS < SEM_SLAB_NINDEX,
+  "the index must be slot-aligned, and never fill up");
+
+/* Local information for a named semaphore that this task has opened.
+ * Each entry is hashed both by name and by address, so that 'sem_open'
+ * and 'sem_close' don't need to scan every mapped semaphore. */
 struct shared_sem
 {
   sem_t *semp;
   int refcount;
-  struct hurd_list link;
+  unsigned int hash;
+  struct sem_slot *slot;
+  struct shared_sem *name_next;
+  struct shared_sem *addr_next;
   char *name;
 };
 
@@ -233,11 +397,14 @@ struct file_data
 extern mach_port_t file_name_lookup (const char *, int, int);
 extern int dir_mkfile (mach_port_t, int, int, mach_port_t *);
 extern int file_getlinknode (mach_port_t, mach_port_t *);
+extern int file_set_size (mach_port_t, loff_t);
 extern int io_write (mach_port_t, const void *,
   size_t, loff_t, mach_msg_type_number_t *);
 extern int dir_link (mach_port_t, mach_port_t, const char *, int);
 extern int io_map (mach_port_t, mach_port_t *, mach_port_t *);
 extern int unlink (const char *);
+extern int file_lock (mach_port_t, int);
+extern int io_stat (mach_port_t, struct stat64 *);
 
 #define file_data_init(fp)   \
   (fp)->file = (fp)->dir = (fp)->memobj = MACH_PORT_NULL
@@ -261,6 +428,34 @@ void file_data_fini (struct file_data *fp)
 /* The prefix used to identify POSIX semaphores. */
 #define SEM_PREFIX   "sem."
 
+/* The prefix of the names of semaphore slabs, which are followed by
+ * the user ID. They cannot clash with the names of semaphores, since
+ * those always begin with the prefix above. */
+#define SEM_SLAB_FILE   "sem-slab."
+
+/* Room for the name of a slab, terminator included. */
+#define SEM_SLAB_NAMELEN   (sizeof (SEM_SLAB_FILE) + 3 * sizeof (uid_t))
+
+/* Make up the path of the calling user's slab in BUFP, which must have
+ * room for SHM_DIR and SEM_SLAB_NAMELEN bytes. Returns the name of the
+ * slab within the directory. */
+static char*
+slab_path (char *bufp)
+{
+  char tmp[3 * sizeof (uid_t)], *p = tmp + sizeof (tmp);
+  uid_t uid = geteuid ();
+
+  do
+    *--p = '0' + uid % 10;
+  while ((uid /= 10) != 0);
+
+  char *name = (char *)mempcpy (bufp, SHM_DIR, sizeof (SHM_DIR) - 1);
+  *(char *)mempcpy (mempcpy (name, SEM_SLAB_FILE,
+    sizeof (SEM_SLAB_FILE) - 1), p, tmp + sizeof (tmp) - p) = '\0';
+
+  return (name);
+}
+
 /* Create an unnamed file in the semaphore directory. */
 static int
 create_anon_file (struct file_data *fp, int flags)
@@ -293,31 +488,33 @@ write_full (struct file_data *fp,
 }
 
 /* Create a hard link between the unnamed file in FP and
- * the file in $SHM_DIR/$SEM_PREFIX$name. */
+ * the file in $SHM_DIR/$NAME. */
 static int
-link_file (struct file_data *fp, const char *name, size_t len)
+link_file (struct file_data *fp, const char *name)
 {
   mach_port_t node;
   int res = file_getlinknode (fp->file, &node);
 
-  if (res != 0)
-    return (-1);
+  if (res == 0)
+    {
+      res = dir_link (fp->dir, node, name, 1);
+      mach_port_deallocate (mach_task_self (), node);
+    }
 
-  /* Create the name with the semaphore prefix. */
-  char *bufp = (char *)alloca (sizeof (SEM_PREFIX) + len);
-  memcpy (mempcpy (bufp, SEM_PREFIX,
-    sizeof (SEM_PREFIX) - 1), name, len);
+  if (res != 0)
+    {
+      errno = res;
+      return (-1);
+    }
 
-  res = dir_link (fp->dir, node, bufp, 1);
-  mach_port_deallocate (mach_task_self (), node);
-  return (res != 0 ? -1 : res);
+  return (0);
 }
 
-/* Map the contents of the file into the task's address space. This is
+/* Map SIZE bytes of the file into the task's address space. This is
  * pretty much the same as 'mmap', only we don't check for some parameters,
  * since we know the mapping is read-write and shared. */
 static void*
-map_file (struct file_data *fp)
+map_file (struct file_data *fp, size_t size)
 {
   mach_port_t dummy;
   if (io_map (fp->file, &dummy, &fp->memobj) != 0)
@@ -328,73 +525,421 @@ map_file (struct file_data *fp)
   vm_offset_t addr;
   vm_prot_t prot = VM_PROT_READ | VM_PROT_WRITE;
 
-  if (vm_map (mach_task_self (), &addr, sizeof (sem_t), 0, 1,
+  if (vm_map (mach_task_self (), &addr, size, 0, 1,
       fp->memobj, 0, 0, prot, prot, VM_INHERIT_SHARE) != 0)
     return (NULL);
 
   return ((void *)addr);
 }
 
-/* The list of shared semaphores that have been mapped by this task,
- * and the lock protecting access to it. We could use a more efficient
- * structure, like a RB tree, but a linked list is sufficient in most
- * cases, since programs rarely need more than a handful semaphores. */
-static HURD_LIST_DECL (__mapped_sems);
+/* The table of shared semaphores that have been mapped by this task,
+ * and the lock protecting access to it. */
+#define SEM_HASH_SIZE   256
+
+static struct shared_sem *__sems_by_name[SEM_HASH_SIZE];
+static struct shared_sem *__sems_by_addr[SEM_HASH_SIZE];
 static unsigned int __mapped_sems_lock;
 
-/* Convert a node in the global list to a shared semaphore. */
-#define node_to_shsem(nodep)   \
-  hurd_list_entry ((nodep), struct shared_sem, link)
+/* The semaphore slab, once mapped, and its file. */
+static struct sem_slab *__sem_slab;
+static mach_port_t __sem_slab_file = MACH_PORT_NULL;
+
+/* FNV-1a hash of a semaphore name. The same value is stored
+ * in the slab, so it must not depend on the task. */
+static inline unsigned int
+hash_name (const char *name, size_t len)
+{
+  unsigned int ret = 2166136261U;
+  for (size_t i = 0; i < len; ++i)
+    ret = (ret ^ (unsigned char)name[i]) * 16777619U;
+
+  return (ret);
+}
+
+#define addr_bucket(semp)   \
+  (((unsigned long)(semp) / sizeof (sem_t)) % SEM_HASH_SIZE)
+
+static struct shared_sem*
+find_by_name (const char *name, size_t len, unsigned int hash)
+{
+  struct shared_sem *sp = __sems_by_name[hash % SEM_HASH_SIZE];
+  for (; sp != NULL; sp = sp->name_next)
+    if (sp->hash == hash && memcmp (sp->name, name, len + 1) == 0)
+      break;
+
+  return (sp);
+}
+
+static struct shared_sem*
+find_by_addr (sem_t *semp)
+{
+  struct shared_sem *sp = __sems_by_addr[addr_bucket (semp)];
+  while (sp != NULL && sp->semp != semp)
+    sp = sp->addr_next;
+
+  return (sp);
+}
+
+/* Remove SP from the name table, if it's still there. This is done
+ * when the name is unlinked, so that later calls to 'sem_open'
+ * don't return the old semaphore. */
+static void
+drop_name (struct shared_sem *sp)
+{
+  struct shared_sem **pp = &__sems_by_name[sp->hash % SEM_HASH_SIZE];
+  for (; *pp != NULL; pp = &(*pp)->name_next)
+    if (*pp == sp)
+      {
+        *pp = sp->name_next;
+        break;
+      }
+
+  sp->name_next = NULL;
+}
+
+static void
+drop_addr (struct shared_sem *sp)
+{
+  struct shared_sem **pp = &__sems_by_addr[addr_bucket (sp->semp)];
+  while (*pp != sp)
+    pp = &(*pp)->addr_next;
+
+  *pp = sp->addr_next;
+}
+
+/* Create a local entry for a named semaphore, and insert it in both
+ * tables. Must be called with the mapped semaphores lock held. */
+static struct shared_sem*
+new_entry (const char *name, size_t len, unsigned int hash,
+  sem_t *semp, struct sem_slot *slot)
+{
+  struct shared_sem *sp =
+    (struct shared_sem *)malloc (sizeof (*sp) + len + 1);
+  if (sp == NULL)
+    {
+      errno = ENOMEM;
+      return (NULL);
+    }
+
+  sp->semp = semp;
+  sp->refcount = 1;
+  sp->hash = hash;
+  sp->slot = slot;
+  memcpy (sp->name = (char *)&sp[1], name, len + 1);
+
+  sp->name_next = __sems_by_name[hash % SEM_HASH_SIZE];
+  __sems_by_name[hash % SEM_HASH_SIZE] = sp;
+  sp->addr_next = __sems_by_addr[addr_bucket (semp)];
+  __sems_by_addr[addr_bucket (semp)] = sp;
+
+  return (sp);
+}
+
+/* Look up an already opened semaphore, bumping its refcount if found.
+ * If SLAB_ONLY is true, only semaphores in the slab are considered.
+ * Must be called with the mapped semaphores lock held. */
+static sem_t*
+lookup_mapping (const char *name, size_t len, unsigned int hash,
+  int slab_only)
+{
+  struct shared_sem *sp = find_by_name (name, len, hash);
+  if (sp == NULL || (slab_only && sp->slot == NULL))
+    return (SEM_FAILED);
+  else if (sp->slot != NULL &&
+      atomic_load (&sp->slot->state) == SEM_SLOT_DEAD)
+    {
+      /* Another task unlinked the name. Any further opens
+       * must refer to a different semaphore. */
+      drop_name (sp);
+      return (SEM_FAILED);
+    }
+
+  ++sp->refcount;
+  return (sp->semp);
+}
 
 static sem_t*
 add_mapping (const char *name, size_t namelen,
   struct file_data *fp, sem_t *prevp)
 {
   sem_t *ret = SEM_FAILED;
+  unsigned int hash = hash_name (name, namelen);
   lll_lock (&__mapped_sems_lock, 0);
 
   /* First, check if there's already a mapping with this name. This can
    * happen if we managed to open the backing file, but didn't create it. */
-  struct hurd_list *runp;
-  hurd_list_each (&__mapped_sems, runp)
+  if ((ret = lookup_mapping (name, namelen, hash, 0)) != SEM_FAILED)
+    goto done;
+
+  /* If the caller didn't provide a mapping, create it now. */
+  if (prevp == SEM_FAILED &&
+      !(prevp = (sem_t *)map_file (fp, sizeof (sem_t))))
+    errno = ENOMEM;
+  else if (new_entry (name, namelen, hash, prevp, NULL) != NULL)
+    ret = prevp;
+
+done:
+  lll_unlock (&__mapped_sems_lock, 0);
+  if (ret != prevp && prevp != SEM_FAILED)
+    vm_deallocate (mach_task_self (),
+      (vm_address_t)prevp, sizeof (*prevp));
+
+  return (ret);
+}
+
+/* Open the calling user's slab in FP, making sure that nobody else
+ * may have tampered with it. */
+static int
+open_slab (struct file_data *fp, const char *path)
+{
+  struct stat64 st;
+
+  fp->file = file_name_lookup (path, O_NOFOLLOW | O_RDWR, 0);
+  if (fp->file == MACH_PORT_NULL)
+    return (-1);
+  else if (io_stat (fp->file, &st) != 0 || st.st_uid != geteuid () ||
+      (st.st_mode & 0777) != SEM_SLAB_MODE)
     {
-      struct shared_sem *sp = node_to_shsem (runp);
-      if (memcmp (sp->name, name, namelen) == 0)
+      /* Not a slab we know about. Don't touch it. */
+      errno = EACCES;
+      return (-1);
+    }
+
+  return (0);
+}
+
+/* Get the semaphore slab, mapping it if needed. If the slab doesn't
+ * exist yet and CREATE is true, create it. Must be called with the
+ * mapped semaphores lock held. */
+static struct sem_slab*
+get_slab (int create)
+{
+  if (__sem_slab != NULL)
+    return (__sem_slab);
+
+  struct file_data fd;
+  struct sem_slab *ret = NULL;
+  int err = errno;
+  char path[sizeof (SHM_DIR) + SEM_SLAB_NAMELEN];
+  const char *name = slab_path (path);
+
+  file_data_init (&fd);
+
+  while (1)
+    {
+      if (open_slab (&fd, path) == 0)
         {
-          /* Found the semaphore. Bump its refcount and return. */
-          ret = sp->semp;
-          ++sp->refcount;
-          goto done;
+          ret = (struct sem_slab *)map_file (&fd, SEM_SLAB_SIZE);
+          if (ret != NULL && (ret->magic != SEM_SLAB_MAGIC ||
+              ret->nslots != SEM_SLAB_NSLOTS))
+            {
+              vm_deallocate (mach_task_self (),
+                (vm_address_t)ret, SEM_SLAB_SIZE);
+              ret = NULL;
+            }
+
+          break;
         }
+      else if (!create || errno != ENOENT)
+        break;
+
+      /* As with single semaphores, the slab must be fully
+       * initialized before it becomes visible to other tasks. */
+      struct sem_slot hdr;
+      struct sem_slab *hp = (struct sem_slab *)&hdr;
+
+      memset (&hdr, 0, sizeof (hdr));
+      hp->magic = SEM_SLAB_MAGIC;
+      hp->nslots = SEM_SLAB_NSLOTS;
+
+      if (create_anon_file (&fd, SEM_SLAB_MODE) < 0 ||
+          write_full (&fd, &hdr, sizeof (hdr)) < 0 ||
+          file_set_size (fd.file, SEM_SLAB_SIZE) != 0)
+        break;
+      else if (link_file (&fd, name) == 0)
+        {
+          ret = (struct sem_slab *)map_file (&fd, SEM_SLAB_SIZE);
+          break;
+        }
+      else if (errno != EEXIST)
+        break;
+
+      /* Someone beat us to it. Use their slab. */
+      file_data_fini (&fd);
     }
 
-  /* We need to create an entry for this semaphore. Allocate the structure
-   * and insert it in the global list. */
-  struct shared_sem *sp =
-    (struct shared_sem *)malloc (sizeof (*sp) + namelen + 1);
-  if (sp != NULL)
+  file_data_fini (&fd);
+
+  /* Failing to map the slab is not an error; we simply fall
+   * back to using a file per semaphore. */
+  errno = err;
+  return (__sem_slab = ret);
+}
+
+/* Serializes the creation and removal of named semaphores between
+ * the threads of this task. A file lock can't do that, since it's
+ * owned by the open file, which they all share. */
+static unsigned int __sem_create_lock;
+
+/* Lock the slab against other tasks, if it's mapped. Must be called
+ * with the creation lock held. Returns -1 on failure. */
+static int
+slab_lock (struct sem_slab *slab)
+{
+  static pid_t owner;
+
+  if (slab == NULL)
+    return (0);
+  else if (owner != getpid ())
     {
-      /* If the caller didn't provide a mapping, create it now. */
-      if (prevp == SEM_FAILED && !(prevp = (sem_t *)map_file (fp)))
+      /* A fork child shares the open file with its parent, and
+       * thus the lock too. Get an open file of our own. */
+      char path[sizeof (SHM_DIR) + SEM_SLAB_NAMELEN];
+      slab_path (path);
+
+      mach_port_t port = file_name_lookup (path, O_NOFOLLOW | O_RDWR, 0);
+      if (port == MACH_PORT_NULL)
+        return (-1);
+      else if (__sem_slab_file != MACH_PORT_NULL)
+        mach_port_deallocate (mach_task_self (), __sem_slab_file);
+
+      __sem_slab_file = port;
+      owner = getpid ();
+    }
+
+  int res;
+  while ((res = file_lock (__sem_slab_file, LOCK_EX)) == EINTR)
+    ;
+
+  if (res != 0)
+    {
+      errno = res;
+      return (-1);
+    }
+
+  return (0);
+}
+
+static void
+slab_unlock (struct sem_slab *slab)
+{
+  if (slab != NULL)
+    file_lock (__sem_slab_file, LOCK_UN);
+}
+
+/* Find the index entry for the semaphore named NAME in SLAB, or the
+ * empty one that ends its probe sequence. Returns null if the index
+ * is damaged. */
+static struct sem_index*
+slab_probe (struct sem_slab *slab, const char *name,
+  size_t len, unsigned int hash)
+{
+  for (unsigned int i = 0; i < SEM_SLAB_NINDEX; ++i)
+    {
+      struct sem_index *ip = &slab->index[(hash + i) % SEM_SLAB_NINDEX];
+      unsigned int slot = atomic_load (&ip->slot);
+
+      if (slot == 0)
+        return (ip);
+      else if (slot <= SEM_SLAB_NSLOTS && atomic_load (&ip->hash) == hash &&
+          memcmp (slab->slots[slot - 1].name, name, len + 1) == 0)
+        return (ip);
+    }
+
+  return (NULL);
+}
+
+/* Return the slot for the index entry IP, or null if it's empty. */
+static inline struct sem_slot*
+slab_slot (struct sem_slab *slab, struct sem_index *ip)
+{
+  unsigned int slot = ip != NULL ? atomic_load (&ip->slot) : 0;
+  return (slot != 0 ? &slab->slots[slot - 1] : NULL);
+}
+
+/* Returned by 'slab_lookup' when the index is being modified. */
+#define SEM_SLAB_BUSY   ((struct sem_slot *)-1)
+
+/* Find the slot for the semaphore named NAME in SLAB without locking it.
+ * Returns null if it isn't present, or SEM_SLAB_BUSY if a consistent
+ * view of the index couldn't be had, in which case the caller has to
+ * lock the slab and look again. */
+static struct sem_slot*
+slab_lookup (struct sem_slab *slab, const char *name,
+  size_t len, unsigned int hash)
+{
+  for (int i = 0; i < 4; ++i)
+    {
+      unsigned int seq = atomic_load (&slab->seq);
+      if (seq & 1)
         {
-          free (sp);
-          errno = ENOMEM;
-          goto done;
+          atomic_spin_nop ();
+          continue;
         }
 
-      sp->refcount = 1;
-      sp->semp = ret = prevp;
-      memcpy (sp->name = (char *)&sp[1], name, namelen + 1);
-      hurd_list_add_tail (&__mapped_sems, &sp->link);
+      struct sem_slot *sl = slab_slot (slab,
+        slab_probe (slab, name, len, hash));
+      if (atomic_load (&slab->seq) == seq)
+        return (sl);
     }
 
-done:
-  lll_unlock (&__mapped_sems_lock, 0);
-  if (ret != prevp && prevp != SEM_FAILED)
-    vm_deallocate (mach_task_self (),
-      (vm_address_t)prevp, sizeof (*prevp));
+  return (SEM_SLAB_BUSY);
+}
 
-  return (ret);
+/* Remove the index entry IP, moving back the entries after it that would
+ * otherwise become unreachable. Must be called with the slab locked. */
+static void
+slab_remove (struct sem_slab *slab, struct sem_index *ip)
+{
+  unsigned int i = ip - slab->index, j = i;
+
+  /* If a previous holder of the lock died halfway, the
+   * sequence number is already odd. */
+  atomic_store (&slab->seq, slab->seq | 1);
+  atomic_mfence ();
+
+  for (unsigned int n = 0; n < SEM_SLAB_NINDEX; ++n)
+    {
+      j = (j + 1) % SEM_SLAB_NINDEX;
+      struct sem_index *jp = &slab->index[j];
+      if (jp->slot == 0)
+        break;
+
+      /* Move the entry into the hole, unless its home
+       * position lies cyclically in (I, J]. */
+      unsigned int k = jp->hash % SEM_SLAB_NINDEX;
+      if (i < j ? k <= i || k > j : k <= i && k > j)
+        {
+          slab->index[i].hash = jp->hash;
+          atomic_store (&slab->index[i].slot, jp->slot);
+          i = j;
+        }
+    }
+
+  atomic_store (&slab->index[i].slot, 0);
+  atomic_store (&slab->seq, slab->seq + 1);
+}
+
+/* Register the semaphore in slot SL, named NAME, as open in this
+ * task. Must be called with the mapped semaphores lock held. */
+static sem_t*
+slab_register (struct sem_slot *sl, const char *name,
+  size_t len, unsigned int hash)
+{
+  struct shared_sem *sp = find_by_addr (&sl->sem);
+  if (sp != NULL)
+    {
+      /* We had it open, but the entry was dropped from the
+       * name table by a stale unlink. Re-add it. */
+      drop_name (sp);
+      sp->name_next = __sems_by_name[hash % SEM_HASH_SIZE];
+      __sems_by_name[hash % SEM_HASH_SIZE] = sp;
+      ++sp->refcount;
+      return (sp->semp);
+    }
+
+  return (new_entry (name, len, hash, &sl->sem, sl) != NULL ?
+    &sl->sem : SEM_FAILED);
 }
 
 static int
@@ -403,31 +948,61 @@ validate_name (const char *name, size_t len)
   return (*name == '/' && memchr (name + 1, '/', len - 1) == NULL);
 }
 
-sem_t* sem_open (const char *name, int oflag, ...)
+/* Make up the name of the backing file for the semaphore
+ * named NAME, of length LEN, in BUFP. */
+static void
+sem_path (char *bufp, const char *name, size_t len)
+{
+  memcpy (mempcpy (mempcpy (bufp, SHM_DIR,
+    sizeof (SHM_DIR) - 1), SEM_PREFIX,
+    sizeof (SEM_PREFIX) - 1), name + 1, len);
+}
+
+/* After creating a backing file for the semaphore named NAME, of
+ * length LEN, check whether the name was put in SLAB in the meantime.
+ * Returns the slot holding it, if so. */
+static struct sem_slot*
+slab_recheck (struct sem_slab *slab, const char *name,
+  size_t len, unsigned int hash)
+{
+  if (slab == NULL || len >= SEM_SLOT_NAMELEN)
+    return (NULL);
+
+  struct sem_slot *sl = slab_lookup (slab, name, len, hash);
+  if (sl == NULL)
+    return (NULL);
+
+  /* Whoever put it there may still back off on seeing our
+   * file. They hold the lock until they're done deciding. */
+  if (slab_lock (slab) < 0)
+    return (NULL);
+
+  sl = slab_slot (slab, slab_probe (slab, name, len, hash));
+  slab_unlock (slab);
+  return (sl);
+}
+
+/* Open or create the semaphore named NAME, of length LEN, with
+ * a backing file. Unless SLAB is null, the caller doesn't hold
+ * the lock for it, and a newly created file is checked against
+ * the names in it. */
+static sem_t*
+file_open (struct sem_slab *slab, const char *name, size_t len,
+  int oflag, mode_t mode, sem_t *tmp)
 {
   struct file_data fd;
   sem_t *ret = SEM_FAILED;
-  size_t len = strlen (name);
   char *bufp = (char *)alloca (sizeof (SHM_DIR) +
     sizeof (SEM_PREFIX) + len + 1);
 
   file_data_init (&fd);
 
-  if (!validate_name (name, len))
-    {
-      errno = EINVAL;
-      return (ret);
-    }
-  else if ((oflag & (O_CREAT | O_EXCL)) != (O_CREAT | O_EXCL))
+  if ((oflag & (O_CREAT | O_EXCL)) != (O_CREAT | O_EXCL))
     {
       /* The semaphore may exist, and we may not have to create it. */
     try_open:
 
-      /* Make up the complete filename. */
-      memcpy (mempcpy (mempcpy (bufp, SHM_DIR,
-        sizeof (SHM_DIR) - 1), SEM_PREFIX,
-        sizeof (SEM_PREFIX) - 1), name + 1, len);
-
+      sem_path (bufp, name, len);
       fd.file = file_name_lookup (bufp, (oflag &
         ~(O_CREAT | O_ACCMODE)) | O_NOFOLLOW | O_RDWR, 0);
 
@@ -443,21 +1018,7 @@ sem_t* sem_open (const char *name, int oflag, ...)
     }
   else
     {
-      va_list ap;
-      sem_t tmp = { .__val_nw = { .hi = 0 }, .__flags = GSYNC_SHARED };
-      mode_t mode;
-
     try_create:
-      va_start (ap, oflag);
-      mode = va_arg (ap, mode_t);
-      tmp.__val_nw.lo = va_arg (ap, unsigned int);
-      va_end (ap);
-
-      if (tmp.__val_nw.lo > SEM_VALUE_MAX)
-        {
-          errno = EINVAL;
-          return (ret);
-        }
 
       /* We have to create an unnamed file first, because the backing file
        * used for shared semaphores must have the actual contents before
@@ -465,10 +1026,14 @@ sem_t* sem_open (const char *name, int oflag, ...)
 
       if (create_anon_file (&fd, mode) < 0)
         return (ret);
-      else if (write_full (&fd, &tmp, sizeof (tmp)) == 0 &&
-          (ret = (sem_t *)map_file (&fd)) != NULL)
+      else if (write_full (&fd, tmp, sizeof (*tmp)) == 0 &&
+          (ret = (sem_t *)map_file (&fd, sizeof (*tmp))) != NULL)
         {
-          if (link_file (&fd, name + 1, len) < 0)
+          char *lname = (char *)alloca (sizeof (SEM_PREFIX) + len);
+          memcpy (mempcpy (lname, SEM_PREFIX,
+            sizeof (SEM_PREFIX) - 1), name + 1, len);
+
+          if (link_file (&fd, lname) < 0)
             {
               /* The hard link failed. This may be because another
                * thread beat us to it. However, if the O_EXCL flag is not
@@ -484,7 +1049,35 @@ sem_t* sem_open (const char *name, int oflag, ...)
                 }
             }
           else
-            ret = add_mapping (name + 1, len - 1, &fd, ret);
+            {
+              unsigned int hash = hash_name (name + 1, len - 1);
+              struct sem_slot *sl =
+                slab_recheck (slab, name + 1, len - 1, hash);
+
+              if (sl == NULL)
+                ret = add_mapping (name + 1, len - 1, &fd, ret);
+              else
+                {
+                  /* The name is taken after all. Remove our
+                   * file, and use the semaphore in the slab. */
+                  sem_path (bufp, name, len);
+                  unlink (bufp);
+                  vm_deallocate (mach_task_self (),
+                    (vm_address_t)ret, sizeof (*ret));
+
+                  if (oflag & O_EXCL)
+                    {
+                      errno = EEXIST;
+                      ret = SEM_FAILED;
+                    }
+                  else
+                    {
+                      lll_lock (&__mapped_sems_lock, 0);
+                      ret = slab_register (sl, name + 1, len - 1, hash);
+                      lll_unlock (&__mapped_sems_lock, 0);
+                    }
+                }
+            }
         }
     }
 
@@ -492,32 +1085,184 @@ sem_t* sem_open (const char *name, int oflag, ...)
   return (ret);
 }
 
+/* Create the semaphore named NAME, of length LEN, in the next free
+ * slot of SLAB, with IP as its index entry, unless there's a backing
+ * file with that name. Must be called with the slab locked. */
+static sem_t*
+slab_create (struct sem_slab *slab, struct sem_index *ip,
+  const char *name, size_t len, int oflag, sem_t *tmp)
+{
+  unsigned int hash = hash_name (name + 1, len - 1);
+  struct sem_slot *sl = &slab->slots[slab->nused];
+  char *bufp = (char *)alloca (sizeof (SHM_DIR) +
+    sizeof (SEM_PREFIX) + len + 1);
+
+  sl->sem = *tmp;
+  sl->hash = hash;
+  memcpy (sl->name, name + 1, len);
+  atomic_store (&sl->state, SEM_SLOT_USED);
+  atomic_store (&slab->nused, slab->nused + 1);
+
+  ip->hash = hash;
+  atomic_store (&ip->slot, slab->nused);
+
+  /* Now that the name is visible, make sure that
+   * nobody created a backing file for it before. */
+  sem_path (bufp, name, len);
+  mach_port_t port = file_name_lookup (bufp, O_NOFOLLOW, 0);
+  sem_t *ret = SEM_FAILED;
+
+  if (port == MACH_PORT_NULL && errno == ENOENT)
+    {
+      lll_lock (&__mapped_sems_lock, 0);
+      ret = slab_register (sl, name + 1, len - 1, hash);
+      lll_unlock (&__mapped_sems_lock, 0);
+
+      if (ret != SEM_FAILED)
+        return (ret);
+    }
+
+  /* Back off, retiring the slot. */
+  atomic_store (&sl->state, SEM_SLOT_DEAD);
+  slab_remove (slab, ip);
+
+  if (port == MACH_PORT_NULL)
+    return (SEM_FAILED);
+
+  /* The name belongs to a backing file. */
+  mach_port_deallocate (mach_task_self (), port);
+  if (oflag & O_EXCL)
+    {
+      errno = EEXIST;
+      return (SEM_FAILED);
+    }
+
+  return (file_open (NULL, name, len, oflag & ~O_CREAT, 0, tmp));
+}
+
+sem_t* sem_open (const char *name, int oflag, ...)
+{
+  sem_t *ret = SEM_FAILED;
+  size_t len = strlen (name);
+  sem_t tmp = { .__val_nw = { .hi = 0 }, .__flags = GSYNC_SHARED };
+  mode_t mode = 0;
+
+  if (!validate_name (name, len))
+    {
+      errno = EINVAL;
+      return (ret);
+    }
+  else if (oflag & O_CREAT)
+    {
+      va_list ap;
+      va_start (ap, oflag);
+      mode = va_arg (ap, mode_t);
+      tmp.__val_nw.lo = va_arg (ap, unsigned int);
+      va_end (ap);
+
+      if (tmp.__val_nw.lo > SEM_VALUE_MAX)
+        {
+          errno = EINVAL;
+          return (ret);
+        }
+    }
+
+  unsigned int hash = hash_name (name + 1, len - 1);
+
+  if ((oflag & (O_CREAT | O_EXCL)) != (O_CREAT | O_EXCL))
+    {
+      /* Fast path: The semaphore is in the slab, and already mapped
+       * by this task. Semaphores with a backing file are looked up
+       * again, since their file may have been unlinked. */
+      lll_lock (&__mapped_sems_lock, 0);
+      ret = lookup_mapping (name + 1, len - 1, hash, 1);
+      lll_unlock (&__mapped_sems_lock, 0);
+
+      if (ret != SEM_FAILED)
+        return (ret);
+    }
+
+  /* Only semaphores that may go in the slab cause it to be created. */
+  int fits = len - 1 < SEM_SLOT_NAMELEN;
+  int slab_p = fits && (oflag & O_CREAT) && (mode & 0777) == SEM_SLAB_MODE;
+
+  lll_lock (&__sem_create_lock, 0);
+  lll_lock (&__mapped_sems_lock, 0);
+  struct sem_slab *slab = get_slab (slab_p);
+  lll_unlock (&__mapped_sems_lock, 0);
+
+  struct sem_slot *sl = NULL;
+  struct sem_index *ip = NULL;
+  int locked = 0;
+
+  slab_p = slab_p && slab != NULL &&
+    atomic_load (&slab->nused) < slab->nslots;
+
+  if (slab != NULL && fits &&
+      ((sl = slab_lookup (slab, name + 1, len - 1, hash)) == SEM_SLAB_BUSY ||
+       (sl == NULL && slab_p)))
+    {
+      /* We may have to add the name to the slab, or we need a stable
+       * view of it. Either way, lock it and look again. */
+      if (slab_lock (slab) < 0)
+        {
+          lll_unlock (&__sem_create_lock, 0);
+          return (ret);
+        }
+
+      locked = 1;
+      ip = slab_probe (slab, name + 1, len - 1, hash);
+      sl = slab_slot (slab, ip);
+    }
+
+  if (sl != NULL)
+    {
+      /* The semaphore lives in the slab. */
+      if ((oflag & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL))
+        errno = EEXIST;
+      else
+        {
+          lll_lock (&__mapped_sems_lock, 0);
+          ret = slab_register (sl, name + 1, len - 1, hash);
+          lll_unlock (&__mapped_sems_lock, 0);
+        }
+    }
+  else if (locked && slab_p && ip != NULL && slab->nused < slab->nslots)
+    ret = slab_create (slab, ip, name, len, oflag, &tmp);
+  else
+    ret = file_open (locked ? NULL : slab, name, len, oflag, mode, &tmp);
+
+  if (locked)
+    slab_unlock (slab);
+
+  lll_unlock (&__sem_create_lock, 0);
+  return (ret);
+}
+
 int sem_close (sem_t *semp)
 {
   int ret = -1;
   lll_lock (&__mapped_sems_lock, 0);
 
-  struct hurd_list *runp;
-  hurd_list_each (&__mapped_sems, runp)
+  struct shared_sem *sp = find_by_addr (semp);
+  if (sp != NULL)
     {
-      struct shared_sem *sp = node_to_shsem (runp);
-      if (sp->semp == semp)
+      /* Found a match. Decrement the refcount and delete the
+       * mapping if it reached zero. Semaphores in the slab
+       * stay mapped along with it. */
+      if (--sp->refcount == 0)
         {
-          /* Found a match. Decrement the refcount and delete the
-           * mapping if it reached zero. */
-          if (--sp->refcount == 0)
-            {
-              hurd_list_del (&sp->link);
-              vm_deallocate (mach_task_self (),
-                (vm_address_t)sp->semp, sizeof (*semp));
-              free (sp);
-            }
+          drop_name (sp);
+          drop_addr (sp);
 
-          /* Signal success for this call, and also break out of the
-           * loop, since there can be no more semaphores with this name. */
-          ret = 0;
-          break;
+          if (sp->slot == NULL)
+            vm_deallocate (mach_task_self (),
+              (vm_address_t)sp->semp, sizeof (*semp));
+
+          free (sp);
         }
+
+      ret = 0;
     }
 
   lll_unlock (&__mapped_sems_lock, 0);
@@ -534,16 +1279,55 @@ int sem_unlink (const char *name)
   if (!validate_name (name, len))
     return (ENOENT);
 
-  char *sname = (char *)alloca (sizeof (SHM_DIR) +
-    sizeof (SEM_PREFIX) + len + 1);
+  int ret = -1;
+  unsigned int hash = hash_name (name + 1, len - 1);
 
-  memcpy (mempcpy (mempcpy (sname, SHM_DIR,
-    sizeof (SHM_DIR) - 1), SEM_PREFIX,
-    sizeof (SEM_PREFIX) - 1), name + 1, len);
+  lll_lock (&__sem_create_lock, 0);
+  lll_lock (&__mapped_sems_lock, 0);
+
+  /* Whatever happens below, this task must no longer find
+   * the semaphore by its name. */
+  struct shared_sem *sp = find_by_name (name + 1, len - 1, hash);
+  if (sp != NULL)
+    drop_name (sp);
+
+  struct sem_slab *slab = get_slab (0);
+  lll_unlock (&__mapped_sems_lock, 0);
+
+  struct sem_slot *sl = NULL;
+  if (slab != NULL && len - 1 < SEM_SLOT_NAMELEN &&
+      slab_lookup (slab, name + 1, len - 1, hash) != NULL)
+    {
+      /* The name is likely in the slab. Only then is it locked. */
+      if (slab_lock (slab) < 0)
+        {
+          lll_unlock (&__sem_create_lock, 0);
+          return (ret);
+        }
 
-  int ret = unlink (sname);
-  if (ret < 0 && errno == EPERM)
-    errno = EACCES;
+      struct sem_index *ip = slab_probe (slab, name + 1, len - 1, hash);
+      if ((sl = slab_slot (slab, ip)) != NULL)
+        {
+          /* Retire the slot. Tasks that have it open can keep using it. */
+          atomic_store (&sl->state, SEM_SLOT_DEAD);
+          slab_remove (slab, ip);
+          ret = 0;
+        }
+
+      slab_unlock (slab);
+    }
+
+  if (sl == NULL)
+    {
+      char *sname = (char *)alloca (sizeof (SHM_DIR) +
+        sizeof (SEM_PREFIX) + len + 1);
+
+      sem_path (sname, name, len);
+      ret = unlink (sname);
+      if (ret < 0 && errno == EPERM)
+        errno = EACCES;
+    }
+
+  lll_unlock (&__sem_create_lock, 0);
   return (ret);
 }
-
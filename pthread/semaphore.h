@@ -69,6 +69,13 @@ extern int sem_timedwait (sem_t *__semp, const struct timespec *__tsp)
  * on, it, wake one of them. */
 extern int sem_post (sem_t *__semp) __THROWNL __nonnull ((1));
 
+/* Increment the count of semaphore SEMP by CNT, and wake up to CNT
+ * waiters. Unlike calling 'sem_post' CNT times, the count is updated
+ * at once. The waiters are woken with a request each, unless all of
+ * them are, in which case a single request is made. */
+extern int sem_post_multiple_np (sem_t *__semp, unsigned int __cnt)
+  __THROWNL __nonnull ((1));
+
 /* Store the semaphore count of SEMP in *OUTP. */
 extern int sem_getvalue (sem_t *__semp, int *__outp)
   __THROW __nonnull ((1, 2));
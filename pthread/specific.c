@@ -19,6 +19,7 @@
 #include "pt-internal.h"
 #include "sysdep.h"
 #include "../sysdeps/atomic.h"
+#include "lowlevellock.h"
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -31,40 +32,230 @@ unused_p (unsigned long seq)
   return (seq % 2 == 0);
 }
 
-int pthread_key_create (pthread_key_t *keyp, void (*destr) (void *))
+/* Keys past the static array live in blocks whose sizes double, so
+ * that a key's block and offset can be computed with a bit scan. Block
+ * number B (the static array being block 0) holds PTHREAD_KEYS_MAX << B
+ * keys, and starts at key (PTHREAD_KEYS_MAX << B) - PTHREAD_KEYS_MAX.
+ * Blocks are installed atomically and never go away, so readers need
+ * no synchronization. */
+
+#define KEY_SHIFT   __builtin_ctz (PTHREAD_KEYS_MAX)
+
+/* Total number of keys that can be addressed. */
+#define KEYS_TOTAL   \
+  (((unsigned int)PTHREAD_KEYS_MAX << (PTHREAD_KEY_NBLOCKS + 1)) -   \
+    PTHREAD_KEYS_MAX)
+
+static inline unsigned int
+key_block (pthread_key_t key)
 {
-  for (int i = 0; i < PTHREAD_KEYS_MAX; ++i)
+  return (31 - __builtin_clz (key + PTHREAD_KEYS_MAX) - KEY_SHIFT);
+}
+
+/* Return the global entry for KEY, or NULL if its block
+ * hasn't been allocated. */
+static inline struct pthread_key_data*
+key_lookup (pthread_key_t key)
+{
+  if (__glibc_likely (key < PTHREAD_KEYS_MAX))
+    return (&__pthread_keys[key]);
+  else if (key >= KEYS_TOTAL)
+    return (NULL);
+
+  unsigned int blk = key_block (key);
+  struct pthread_key_data *bp = atomic_load (&__pthread_key_blocks[blk - 1]);
+
+  return (bp == NULL ? NULL :
+    bp + key + PTHREAD_KEYS_MAX - (PTHREAD_KEYS_MAX << blk));
+}
+
+/* Get the key block number BLK, allocating it if needed. */
+static struct pthread_key_data*
+key_block_get (unsigned int blk)
+{
+  struct pthread_key_data *bp = atomic_load (&__pthread_key_blocks[blk - 1]);
+  if (bp != NULL)
+    return (bp);
+
+  bp = (struct pthread_key_data *)calloc (PTHREAD_KEYS_MAX << blk,
+    sizeof (*bp));
+
+  if (bp == NULL)
+    return (NULL);
+  else if (!atomic_cas_bool (&__pthread_key_blocks[blk - 1],
+      (struct pthread_key_data *)NULL, bp))
     {
-      unsigned long seq = __pthread_keys[i].seq;
-      if (unused_p (seq) &&
-          atomic_cas_bool (&__pthread_keys[i].seq, seq, seq + 1))
+      /* Someone else beat us to it. */
+      free (bp);
+      bp = __pthread_key_blocks[blk - 1];
+    }
+
+  return (bp);
+}
+
+/* Deleted keys are kept in a lock-free stack, linked through their
+ * global entries. The head holds the index of the top key plus one,
+ * tagged with the sequence number the key had when it was pushed. Since
+ * a key's sequence number changes every time it's created or deleted,
+ * a stale head never compares equal, which avoids the ABA problem.
+ *
+ * Keys that have never been used are not in the stack. Instead, they
+ * are handed out in order by bumping __pthread_key_hwm. */
+
+/* Pop a key from the free stack into *KEYP. Returns zero if empty. */
+static int
+key_pop (pthread_key_t *keyp)
+{
+  while (1)
+    {
+      union hurd_xint head = { atomic_loadx (&__pthread_key_free.qv) };
+      if (head.lo == 0)
+        return (0);
+
+      /* The link may be garbage if someone else popped this key in the
+       * meantime, but then the CAS below is bound to fail. */
+      unsigned int next = atomic_load (&key_lookup (head.lo - 1)->next);
+      struct pthread_key_data *np = next == 0 ? NULL : key_lookup (next - 1);
+
+      if (atomic_casx_bool (&__pthread_key_free.qv, head.lo, head.hi,
+          np != NULL ? next : 0, np != NULL ? np->seq : 0))
         {
-          __pthread_keys[i].destr = destr;
-          *keyp = i;
+          *keyp = head.lo - 1;
+          return (1);
+        }
+    }
+}
+
+/* Push KEY, described by KP and whose sequence number is SEQ,
+ * into the free stack. */
+static void
+key_push (pthread_key_t key, struct pthread_key_data *kp, unsigned long seq)
+{
+  while (1)
+    {
+      union hurd_xint head = { atomic_loadx (&__pthread_key_free.qv) };
+      kp->next = head.lo;
+
+      if (atomic_casx_bool (&__pthread_key_free.qv,
+          head.lo, head.hi, key + 1, seq))
+        break;
+    }
+}
+
+/* Reserve N never-used keys, storing the first one in *KEYP. */
+static int
+key_reserve (unsigned int n, pthread_key_t *keyp)
+{
+  while (1)
+    {
+      unsigned int base = atomic_load (&__pthread_key_hwm);
+      if (n > KEYS_TOTAL - base)
+        return (EAGAIN);
+
+      /* Make sure the blocks for the range are there before
+       * publishing it. */
+      for (unsigned int blk = key_block (base);
+          blk <= key_block (base + n - 1); ++blk)
+        if (blk > 0 && key_block_get (blk) == NULL)
+          return (ENOMEM);
+
+      if (atomic_cas_bool (&__pthread_key_hwm, base, base + n))
+        {
+          *keyp = base;
           return (0);
         }
     }
+}
 
-  return (EAGAIN);
+/* Mark KEY as used, with destructor DESTR. */
+static void
+key_claim (pthread_key_t key, void (*destr) (void *))
+{
+  struct pthread_key_data *kp = key_lookup (key);
+  kp->destr = destr;
+  atomic_add (&kp->seq, 1);
+}
+
+int pthread_key_create (pthread_key_t *keyp, void (*destr) (void *))
+{
+  pthread_key_t key;
+
+  if (!key_pop (&key))
+    {
+      int ret = key_reserve (1, &key);
+      if (ret != 0)
+        return (ret);
+    }
+
+  key_claim (key, destr);
+  *keyp = key;
+  return (0);
+}
+
+int pthread_key_create_n_np (pthread_key_t *keys, unsigned int n,
+  void (*destr) (void *))
+{
+  unsigned int i;
+
+  /* Reuse deleted keys first. */
+  for (i = 0; i < n && key_pop (&keys[i]); ++i)
+    ;
+
+  if (i < n)
+    {
+      pthread_key_t base;
+      int ret = key_reserve (n - i, &base);
+
+      if (ret != 0)
+        {
+          /* Put back the keys we took. They are still unused, but
+           * their sequence numbers must change to get a new tag. */
+          while (i-- > 0)
+            {
+              struct pthread_key_data *kp = key_lookup (keys[i]);
+              key_push (keys[i], kp, atomic_add (&kp->seq, 2) + 2);
+            }
+
+          return (ret);
+        }
+
+      for (unsigned int j = i; j < n; ++j)
+        keys[j] = base + j - i;
+    }
+
+  for (i = 0; i < n; ++i)
+    key_claim (keys[i], destr);
+
+  return (0);
 }
 
 int pthread_key_delete (pthread_key_t key)
 {
-  if (key >= PTHREAD_KEYS_MAX || unused_p (__pthread_keys[key].seq))
+  struct pthread_key_data *kp = key_lookup (key);
+  unsigned long seq;
+
+  if (kp == NULL || unused_p ((seq = kp->seq)) ||
+      !atomic_cas_bool (&kp->seq, seq, seq + 1))
     return (EINVAL);
 
-  atomic_add (&__pthread_keys[key].seq, 1);
+  key_push (key, kp, seq + 1);
   return (0);
 }
 
 void* pthread_getspecific (pthread_key_t key)
 {
-  if (key >= PTHREAD_KEYS_MAX)
-    return (NULL);
-
   struct pthread *self = PTHREAD_SELF;
   unsigned int idx = key / PTHREAD_KEY_L2_SIZE;
-  struct pthread_key_data *lp = self->specific[idx];
+  struct pthread_key_data *lp;
+
+  if (__glibc_likely (idx == 0))
+    lp = self->specific_blk1;
+  else if (idx < PTHREAD_KEY_L1_SIZE)
+    lp = self->specific[idx];
+  else if (idx - PTHREAD_KEY_L1_SIZE < self->specific_ext_size)
+    lp = self->specific_ext[idx - PTHREAD_KEY_L1_SIZE];
+  else
+    return (NULL);
 
   if (lp == NULL)
     return (NULL);
@@ -72,25 +263,83 @@ void* pthread_getspecific (pthread_key_t key)
   lp += key % PTHREAD_KEY_L2_SIZE;
   void *retp = lp->data;
 
-  /* Test that the key sequence matches with the global array. */
+  /* Test that the key sequence matches with the global array. A
+   * non-null value means that the key's block has been allocated. */
   if (__glibc_unlikely (retp != NULL &&
-      lp->seq != __pthread_keys[key].seq))
+      lp->seq != key_lookup (key)->seq))
     retp = lp->data = NULL;
 
   return (retp);
 }
 
+/* Return the address of the L1 slot with index IDX for the calling
+ * thread. If GROW is false, return NULL instead of allocating memory. */
+static struct pthread_key_data**
+l1_slot (struct pthread *self, unsigned int idx, int grow)
+{
+  if (__glibc_likely (idx < PTHREAD_KEY_L1_SIZE))
+    return (&self->specific[idx]);
+
+  idx -= PTHREAD_KEY_L1_SIZE;
+  if (idx >= self->specific_ext_size)
+    {
+      if (!grow)
+        return (NULL);
+
+      /* The secondary array is only ever accessed by
+       * its owner, so we can simply reallocate it. Keep the size
+       * even so that the bitmap is made of whole words. */
+      unsigned int osize = self->specific_ext_size;
+      unsigned int nsize = osize * 2;
+      if (nsize <= idx)
+        nsize = (idx + 2) & ~1U;
+
+      /* Grow the bitmap first. If growing the array fails
+       * afterwards, a larger bitmap is harmless. */
+      unsigned int *map = (unsigned int *)
+        realloc (self->specific_ext_map, nsize / 2 * sizeof (*map));
+
+      if (map == NULL)
+        return (NULL);
+
+      memset (map + osize / 2, 0, (nsize - osize) / 2 * sizeof (*map));
+      self->specific_ext_map = map;
+
+      struct pthread_key_data **ext = (struct pthread_key_data **)
+        realloc (self->specific_ext, nsize * sizeof (*ext));
+
+      if (ext == NULL)
+        return (NULL);
+
+      memset (ext + osize, 0, (nsize - osize) * sizeof (*ext));
+      self->specific_ext = ext;
+      self->specific_ext_size = nsize;
+    }
+
+  return (&self->specific_ext[idx]);
+}
+
+/* Return the word in the bitmap of keys for THREAD that contains
+ * the bit for KEY. */
+static inline unsigned int*
+map_word (struct pthread *pt, pthread_key_t key)
+{
+  return (key < PTHREAD_KEYS_MAX ? &pt->specific_map[key / 32] :
+    &pt->specific_ext_map[(key - PTHREAD_KEYS_MAX) / 32]);
+}
+
 int pthread_setspecific (pthread_key_t key, const void *valp)
 {
+  struct pthread_key_data *kp = key_lookup (key);
   unsigned long seq;
 
-  if (key >= PTHREAD_KEYS_MAX ||
-      unused_p ((seq = __pthread_keys[key].seq)))
+  if (kp == NULL || unused_p ((seq = kp->seq)))
     return (EINVAL);
 
   struct pthread *self = PTHREAD_SELF;
-  unsigned int idx = key / PTHREAD_KEY_L2_SIZE;
-  struct pthread_key_data *lp = self->specific[idx];
+  struct pthread_key_data **l1p =
+    l1_slot (self, key / PTHREAD_KEY_L2_SIZE, valp != NULL);
+  struct pthread_key_data *lp = l1p == NULL ? NULL : *l1p;
 
   if (lp == NULL)
     {
@@ -98,6 +347,8 @@ int pthread_setspecific (pthread_key_t key, const void *valp)
         /* Don't bother with memory allocations if we were
          * going to set a null pointer anyways. */
         return (0);
+      else if (l1p == NULL)
+        return (ENOMEM);
 
       lp = (struct pthread_key_data *)
         calloc (PTHREAD_KEY_L2_SIZE, sizeof (*lp));
@@ -105,7 +356,7 @@ int pthread_setspecific (pthread_key_t key, const void *valp)
       if (lp == NULL)
         return (ENOMEM);
 
-      self->specific[idx] = lp;
+      *l1p = lp;
     }
 
   lp += key % PTHREAD_KEY_L2_SIZE;
@@ -113,61 +364,203 @@ int pthread_setspecific (pthread_key_t key, const void *valp)
   lp->seq = seq;
   lp->data = (void *)valp;
 
-  /* Only set the specific flag if the value needs destruction
-   * during thread-exit time. */
+  /* Only set the specific flag and the key's bit if the value
+   * needs destruction during thread-exit time. */
   if (__glibc_likely (valp != NULL))
-    self->specific_used = 1;
+    {
+      *map_word (self, key) |= 1U << (key % 32);
+      self->specific_used = 1;
+    }
+  else
+    *map_word (self, key) &= ~(1U << (key % 32));
+
+  return (0);
+}
+
+/* Fast keys.
+ *
+ * The values are kept in an array in static TLS, so every thread has
+ * it at the same offset from its thread pointer. That lets us skip the
+ * sequence check when reading them: instead, deleting a fast key clears
+ * its slot in every running thread.
+ *
+ * Exiting threads leave the running list before their destructors run,
+ * so a key may be deleted (and even recreated) without their slots being
+ * cleared. To cope with that, they save the sequence numbers of the fast
+ * keys before leaving, and only run the destructors of the keys whose
+ * sequence numbers still match. */
+
+__thread void *__pthread_fast_slots[PTHREAD_FAST_KEYS_NP]
+  __attribute__ ((tls_model ("initial-exec")));
+
+static __thread unsigned long fast_seqs[PTHREAD_FAST_KEYS_NP]
+  __attribute__ ((tls_model ("initial-exec")));
+
+int pthread_fast_key_create_np (pthread_key_t *keyp, void (*destr) (void *))
+{
+  for (int i = 0; i < PTHREAD_FAST_KEYS_NP; ++i)
+    {
+      unsigned long seq = __pthread_fast_keys[i].seq;
+      if (unused_p (seq) &&
+          atomic_cas_bool (&__pthread_fast_keys[i].seq, seq, seq + 1))
+        {
+          __pthread_fast_keys[i].destr = destr;
+          *keyp = i;
+          return (0);
+        }
+    }
+
+  return (EAGAIN);
+}
+
+int pthread_fast_key_delete_np (pthread_key_t key)
+{
+  if (key >= PTHREAD_FAST_KEYS_NP)
+    return (EINVAL);
+
+  PTHREAD_FORK_FINISH ();
+  unsigned long seq = __pthread_fast_keys[key].seq;
+  if (unused_p (seq))
+    return (EINVAL);
+
+  /* Clear the slot in every thread before the key can be reused. */
+  ptrdiff_t off = (char *)&__pthread_fast_slots[key] - (char *)GET_TCB ();
+  struct hurd_list *runp;
+
+  __pthread_lock_running ();
+  for (int i = 0; i < PTHREAD_RUNNING_NLISTS; ++i)
+    hurd_list_each (&__running_threads[i].list, runp)
+      {
+        struct pthread *pt = hurd_list_entry (runp, struct pthread, link);
+        *(void **)((char *)pt->tcb + off) = NULL;
+      }
+
+  __pthread_unlock_running ();
+
+  return (atomic_cas_bool (&__pthread_fast_keys[key].seq,
+    seq, seq + 1) ? 0 : EINVAL);
+}
+
+void* (pthread_fast_getspecific_np) (pthread_key_t key)
+{
+  return (__pthread_fast_slots[key]);
+}
 
+int (pthread_fast_setspecific_np) (pthread_key_t key, const void *valp)
+{
+  __pthread_fast_slots[key] = (void *)valp;
   return (0);
 }
 
+void __pthread_save_fast_keys (void)
+{
+  for (int i = 0; i < PTHREAD_FAST_KEYS_NP; ++i)
+    fast_seqs[i] = atomic_load (&__pthread_fast_keys[i].seq);
+}
+
+/* Run the destructors for the fast keys of the calling thread.
+ * Returns nonzero if any slot had a value. */
+static int
+destroy_fast (void)
+{
+  int ret = 0;
+
+  for (int i = 0; i < PTHREAD_FAST_KEYS_NP; ++i)
+    {
+      void *dp = __pthread_fast_slots[i];
+      if (dp == NULL)
+        continue;
+
+      __pthread_fast_slots[i] = NULL;
+      ret = 1;
+
+      /* Only run the destructor if the key wasn't deleted
+       * since we left the running list. */
+      unsigned long seq = atomic_load (&__pthread_fast_keys[i].seq);
+      if (seq == fast_seqs[i] && !unused_p (seq) &&
+          __pthread_fast_keys[i].destr != NULL)
+        __pthread_fast_keys[i].destr (dp);
+    }
+
+  return (ret);
+}
+
+/* Run the destructor for KEY in thread PT, if it has a value. */
+static void
+destroy_key (struct pthread *pt, pthread_key_t key)
+{
+  unsigned int idx = key / PTHREAD_KEY_L2_SIZE;
+  struct pthread_key_data *lp = idx < PTHREAD_KEY_L1_SIZE ?
+    pt->specific[idx] : pt->specific_ext[idx - PTHREAD_KEY_L1_SIZE];
+
+  lp += key % PTHREAD_KEY_L2_SIZE;
+  void *dp = lp->data;
+  if (dp == NULL)
+    return;
+
+  /* Clear the data before (potentially) running
+   * the destructor callback. */
+  lp->data = NULL;
+
+  /* Only run the destructor if the key is valid and if
+   * a callback was actually registered for this key. */
+  struct pthread_key_data *kp = key_lookup (key);
+  if (lp->seq == kp->seq && kp->destr != NULL)
+    kp->destr (dp);
+}
+
+/* Run the destructors for the keys set in the primary bitmap
+ * of thread PT, or in the secondary one if EXT is true. */
+static void
+destroy_map (struct pthread *pt, int ext)
+{
+  for (unsigned int i = 0; ; ++i)
+    {
+      /* Destructors may grow the secondary bitmap,
+       * so it must be reloaded every time. */
+      unsigned int *map = ext ? pt->specific_ext_map : pt->specific_map;
+      if (i >= (ext ? pt->specific_ext_size / 2 : PTHREAD_KEY_MAP_SIZE))
+        break;
+
+      /* Bits set by the destructors are handled on the next pass. */
+      unsigned int bits = map[i];
+      pthread_key_t base = (ext ? PTHREAD_KEYS_MAX : 0) + i * 32;
+
+      map[i] = 0;
+      for (; bits != 0; bits &= bits - 1)
+        destroy_key (pt, base + __builtin_ctz (bits));
+    }
+}
+
 void __pthread_dealloc_tsd (struct pthread *pt)
 {
+  /* Fast keys are handled first, since setting them doesn't
+   * update the specific flag. */
+  int fast = destroy_fast ();
+
   /* Avoid doing any work if no thread-specific data was allocated. */
-  if (!pt->specific_used)
+  if (!pt->specific_used && !fast)
     return;
 
   int cnt, iters = 0;
 
   do
     {
-      int q;
-
       pt->specific_used = 0;
-      for (q = cnt = 0; cnt < PTHREAD_KEY_L1_SIZE; ++cnt)
-        {
-          struct pthread_key_data *l2 = pt->specific[cnt];
-          if (l2 == NULL)
-            {
-              q += PTHREAD_KEY_L1_SIZE;
-              continue;
-            }
-
-          for (int inner = 0; inner < PTHREAD_KEY_L2_SIZE; ++inner, ++q)
-            {
-              void *dp = l2[inner].data;
-              if (dp == NULL)
-                continue;
-
-              /* Clear the data before (potentially) running
-               * the destructor callback. */
-              l2[inner].data = NULL;
-
-              /* Only run the destructor if the key is valid and if
-               * a callback was actually registered for this key. */
-              if (l2[inner].seq == __pthread_keys[q].seq &&
-                  __pthread_keys[q].destr != NULL)
-                __pthread_keys[q].destr (dp);
-            }
-        }
+      destroy_map (pt, 0);
+      destroy_map (pt, 1);
+      fast = destroy_fast ();
 
       /* If no more thread-specific data was allocated, we're done. */
-      if (!pt->specific_used)
+      if (!pt->specific_used && !fast)
         break;
     }
   while (++iters < PTHREAD_DESTRUCTION_ITERATIONS);
 
+  memset (__pthread_fast_slots, 0, sizeof (__pthread_fast_slots));
+
   memset (pt->specific_blk1, 0, sizeof (pt->specific_blk1));
+  memset (pt->specific_map, 0, sizeof (pt->specific_map));
 
   for (cnt = 1; cnt < PTHREAD_KEY_L1_SIZE; ++cnt)
     {
@@ -175,6 +568,13 @@ void __pthread_dealloc_tsd (struct pthread *pt)
       pt->specific[cnt] = NULL;
     }
 
+  for (cnt = 0; cnt < (int)pt->specific_ext_size; ++cnt)
+    free (pt->specific_ext[cnt]);
+
+  free (pt->specific_ext);
+  free (pt->specific_ext_map);
+  pt->specific_ext = NULL;
+  pt->specific_ext_map = NULL;
+  pt->specific_ext_size = 0;
   pt->specific_used = 0;
 }
-
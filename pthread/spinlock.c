@@ -17,11 +17,31 @@
 */
 
 #include "pt-internal.h"
+#include "lowlevellock.h"
 #include "../sysdeps/atomic.h"
 #include <errno.h>
+#include <mach.h>
+#include <mach/thread_switch.h>
 
 #define SPIN_UNLOCKED   PTHREAD_SPINLOCK_INITIALIZER
-#define SPIN_LOCKED     (SPIN_UNLOCKED ^ 1)
+
+/* Spinlocks are ticket locks. The lower half of the lock word holds the
+ * ticket being served, and the upper half holds the next ticket to be
+ * handed out. Waiters are thus served in FIFO order, and they only read
+ * the lock word while spinning. Since everything is kept in the lock
+ * word itself, this works across processes as well. */
+
+typedef union
+{
+  pthread_spinlock_t word;
+  struct
+    {
+      unsigned short owner;
+      unsigned short next;
+    };
+} __attribute__ ((__may_alias__)) spin_ticket_t;
+
+#define SPIN_TICKET   (1L << 16)
 
 int pthread_spin_init (pthread_spinlock_t *lockp, int pshared)
 {
@@ -33,23 +53,63 @@ int pthread_spin_init (pthread_spinlock_t *lockp, int pshared)
   return (0);
 }
 
-/* XXX: This constant needs some tuning. */
-#define NSPINS   1000
+/* Number of pauses per waiter ahead of us. Roughly the time it takes
+ * to hand the lock over and run a short critical section. */
+#define SPIN_BACKOFF   64
+
+/* The backoff doubles every round that the lock doesn't change hands,
+ * up to this many times. */
+#define SPIN_BACKOFF_SHIFT   4
+
+/* If the lock doesn't change hands after this many rounds, the thread
+ * that we are waiting for has most likely been preempted, so we yield
+ * the processor instead of spinning. */
+#define SPIN_YIELD_ROUNDS   16
+
+/* If yielding doesn't help either, sleep for short periods of time. */
+#define SPIN_SLEEP_ROUNDS   (SPIN_YIELD_ROUNDS + 16)
+#define SPIN_SLEEP_MS       1
 
 int pthread_spin_lock (pthread_spinlock_t *lockp)
 {
+  spin_ticket_t *tp = (spin_ticket_t *)lockp;
+  unsigned short ticket =
+    (unsigned short)(atomic_add (&tp->word, SPIN_TICKET) >> 16);
+  unsigned short prev = ticket;
+  unsigned int stall = 0;
+
   while (1)
     {
-      if (atomic_swap (lockp, SPIN_LOCKED) == SPIN_UNLOCKED)
+      spin_ticket_t tmp = { .word = atomic_load (&tp->word) };
+      if (tmp.owner == ticket)
         break;
+      else if (tmp.owner != prev)
+        {
+          /* The queue moved. Go back to spinning. */
+          prev = tmp.owner;
+          stall = 0;
+        }
+
+      if (++stall <= SPIN_YIELD_ROUNDS)
+        {
+          /* Back off in proportion to our place in the queue, so as
+           * to keep the traffic on the lock word low. */
+          unsigned int n = (unsigned short)(ticket - tmp.owner) *
+            SPIN_BACKOFF << (stall < SPIN_BACKOFF_SHIFT ?
+              stall : SPIN_BACKOFF_SHIFT);
 
-      int nspins = NSPINS;
-      while (*lockp == SPIN_LOCKED && --nspins != 0)
-#if defined (i386) || defined (__i386__)
-        __asm__ ("pause");
-#else
-        atomic_mfence_acq ();
-#endif
+          while (n-- != 0)
+            atomic_spin_nop ();
+        }
+      else if (stall <= SPIN_SLEEP_ROUNDS)
+        /* Let the threads ahead of us run, depressing our priority
+         * so that we aren't picked again right away. */
+        thread_switch (MACH_PORT_NULL, SWITCH_OPTION_DEPRESS, SPIN_SLEEP_MS);
+      else
+        /* Nobody wakes us up, since unlocking is just a store, but the
+         * wait returns at once if the lock word has already changed,
+         * and times out otherwise. */
+        lll_timed_wait (&tp->word, (int)tmp.word, SPIN_SLEEP_MS, 0);
     }
 
   return (0);
@@ -57,13 +117,20 @@ int pthread_spin_lock (pthread_spinlock_t *lockp)
 
 int pthread_spin_trylock (pthread_spinlock_t *lockp)
 {
-  return (*lockp != SPIN_UNLOCKED ||
-    atomic_swap (lockp, SPIN_LOCKED) != SPIN_UNLOCKED ? EBUSY : 0);
+  spin_ticket_t *tp = (spin_ticket_t *)lockp;
+  spin_ticket_t tmp = { .word = atomic_load (&tp->word) };
+
+  return (tmp.owner != tmp.next ||
+    !atomic_cas_bool (&tp->word, tmp.word,
+      tmp.word + SPIN_TICKET) ? EBUSY : 0);
 }
 
 int pthread_spin_unlock (pthread_spinlock_t *lockp)
 {
-  atomic_store (lockp, SPIN_UNLOCKED);
+  spin_ticket_t *tp = (spin_ticket_t *)lockp;
+
+  /* Only the owner modifies this half. */
+  atomic_store (&tp->owner, (unsigned short)(tp->owner + 1));
   return (0);
 }
 
@@ -72,4 +139,3 @@ int pthread_spin_destroy (pthread_spinlock_t *lockp)
   (void)lockp;
   return (0);
 }
-
@@ -59,4 +59,9 @@
 #define atomic_mfence()   \
   __atomic_thread_fence (__ATOMIC_SEQ_CST)
 
+#ifndef atomic_spin_nop
+  /* Hint to the CPU that we are inside a busy-wait loop. */
+#  define atomic_spin_nop()   atomic_mfence_acq ()
+#endif
+
 #endif
@@ -105,6 +105,12 @@ typedef struct
        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);   \
    })
 
+#undef atomic_spin_nop
+
+/* The 'pause' instruction improves the performance of spin-wait
+ * loops, and reduces power consumption while doing so. */
+#define atomic_spin_nop()   __asm__ __volatile__ ("pause" ::: "memory")
+
 /* Atomic operations for 64-bit values. */
 
 #if __SSE2__